@@ -0,0 +1,90 @@
+#!/bin/sh
+# Build an optimized pera and time each bench/*.pera with it, comparing
+# the median against bench/baseline.txt.
+#
+#   bench/run.sh [--save] [pera flags...]
+#
+# RUNS sets the runs per benchmark (5), THRESHOLD the percentage slower
+# than the baseline that counts as a regression (10). --save records the
+# medians as the new baseline for these flags. Exits with 1 on a
+# regression or a failed run.
+
+cd "$(dirname "$0")" || exit 1
+
+save=false
+if [ "$1" = "--save" ]; then
+  save=true
+  shift
+fi
+flags="$*"
+runs=${RUNS:-5}
+threshold=${THRESHOLD:-10}
+baseline=baseline.txt
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+${CC:-cc} -O2 ../pera.c -lm -o "$tmp/pera" || exit 1
+
+status=0
+printf '%-14s %10s %10s %10s %8s\n' benchmark median variance baseline change
+for bench in *.pera; do
+  name=${bench%.pera}
+  key="$name${flags:+ $flags}"
+
+  : > "$tmp/times"
+  i=0
+  while [ $i -lt "$runs" ]; do
+    start=$(date +%s%N)
+    if ! "$tmp/pera" $flags "$bench" > /dev/null 2>&1; then
+      echo "$name: failed" >&2
+      status=1
+      continue 2
+    fi
+    end=$(date +%s%N)
+    echo $(( (end - start) / 1000 )) >> "$tmp/times"
+    i=$((i + 1))
+  done
+
+  # times are in microseconds, reported in milliseconds
+  stats=$(sort -n "$tmp/times" | awk '
+    { t[NR] = $1 / 1000; sum += t[NR] }
+    END {
+      median = NR % 2 ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2
+      mean = sum / NR
+      for (i = 1; i <= NR; i++)
+        var += (t[i] - mean) ^ 2
+      printf "%.2f %.3f", median, (NR > 1 ? var / (NR - 1) : 0)
+    }')
+  median=${stats% *}
+  variance=${stats#* }
+
+  old=$(awk -v key="$key" '{ m = $NF; $NF = "" ; sub(/ $/, "") }
+                           $0 == key { print m }' "$baseline" 2>/dev/null)
+  if [ -z "$old" ]; then
+    printf '%-14s %10s %10s %10s %8s\n' "$name" "$median" "$variance" - -
+  else
+    change=$(awk -v new="$median" -v old="$old" \
+      'BEGIN { printf "%+.1f%%", (new - old) * 100 / old }')
+    note=
+    if awk -v new="$median" -v old="$old" -v t="$threshold" \
+      'BEGIN { exit !(new > old * (1 + t / 100)) }'; then
+      note=" REGRESSION"
+      status=1
+    fi
+    printf '%-14s %10s %10s %10s %8s%s\n' "$name" "$median" "$variance" \
+      "$old" "$change" "$note"
+  fi
+  echo "$key $median" >> "$tmp/medians"
+done
+
+if $save && [ -f "$tmp/medians" ]; then
+  # keep the entries recorded with other flags
+  awk -v flags="$flags" '{ line = $0; $NF = ""; sub(/ $/, "")
+      n = split($0, f, " "); rest = ""
+      for (i = 2; i <= n; i++) rest = rest (i > 2 ? " " : "") f[i]
+      if (rest != flags) print line }' "$baseline" 2>/dev/null > "$tmp/kept"
+  sort "$tmp/kept" "$tmp/medians" > "$baseline"
+  echo "saved $baseline"
+fi
+
+exit $status
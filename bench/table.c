@@ -0,0 +1,362 @@
+/* time the hash table in pera.c against the linear probing table it
+   replaced, on the same keys, in nanoseconds per operation (best of RUNS)
+
+     cc -O2 bench/table.c -lm -o table && ./table
+
+   build with -DNO_SIMD_TABLE to time the new table without SSE2 */
+
+#define main pera_main
+#include "../pera.c"
+#undef main
+
+#define RUNS 6
+/* each measurement repeats its pass over the keys to do at least this many
+   operations, so the small tables aren't timed in single microseconds */
+#define MIN_OPS (1 << 22)
+
+/* OLD TABLE, as it was before the group probing */
+
+typedef struct
+{
+  int count;
+  int capacity;
+  pair_t *pairs;
+} old_table_t;
+
+void
+old_table_fill_null_pairs (pair_t *pairs, int capacity)
+{
+  for (int i = 0; i < capacity; i++)
+    {
+      pairs[i].key = NULL;
+      pairs[i].value = value_nil ();
+    }
+}
+
+void
+old_table_new (old_table_t *table)
+{
+  table->count = 0;
+  table->capacity = 8;
+  table->pairs = malloc (8 * sizeof (pair_t));
+  old_table_fill_null_pairs (table->pairs, table->capacity);
+}
+
+pair_t *
+old_table_get (old_table_t *table, string_t *key)
+{
+  uint32_t i = key->hash % table->capacity;
+  pair_t *dead = NULL;
+
+  while (1)
+    {
+      pair_t *pair = &table->pairs[i];
+      if (pair->key == NULL)
+        {
+          /* check for empty pair */
+          if (value_is_nil (pair->value))
+            return dead == NULL ? pair : dead;
+          /* else it's a dead pair */
+          else if (dead == NULL)
+            dead = pair;
+        }
+      else if (pair->key == key)
+        {
+          return pair;
+        }
+      i = (i + 1) % table->capacity;
+    }
+}
+
+string_t *
+old_table_find_string (old_table_t *table, const char *a, int len_a,
+                       const char *b, int len_b, uint32_t hash)
+{
+  if (table->count == 0)
+    return NULL;
+
+  uint32_t i = hash % table->capacity;
+  while (1)
+    {
+      pair_t *pair = &table->pairs[i];
+      if (pair->key == NULL)
+        {
+          /* check for empty pair */
+          if (value_is_nil (pair->value))
+            return NULL;
+        }
+      else if (table_key_equals_chars (pair, a, len_a, b, len_b, hash))
+        {
+          return pair->key;
+        }
+      i = (i + 1) % table->capacity;
+    }
+}
+
+void
+old_table_grow (old_table_t *table)
+{
+  int new_capacity = table->capacity * 2;
+  pair_t *new_pairs = malloc (new_capacity * sizeof (pair_t));
+  old_table_fill_null_pairs (new_pairs, new_capacity);
+
+  pair_t *old_pairs = table->pairs;
+  int old_capacity = table->capacity;
+
+  /* rehash into the new pairs, dropping dead ones */
+  table->count = 0;
+  table->capacity = new_capacity;
+  table->pairs = new_pairs;
+  for (int i = 0; i < old_capacity; i++)
+    {
+      pair_t *pair = &old_pairs[i];
+      if (pair->key == NULL)
+        continue;
+
+      pair_t *dest_pair = old_table_get (table, pair->key);
+      dest_pair->key = pair->key;
+      dest_pair->value = pair->value;
+
+      table->count++;
+    }
+
+  free (old_pairs);
+}
+
+bool
+old_table_set (old_table_t *table, string_t *key, value_t value)
+{
+  if (table->count + 1 > table->capacity * TABLE_LOAD)
+    old_table_grow (table);
+  pair_t *pair = old_table_get (table, key);
+  bool is_new = pair->key == NULL;
+  if (is_new && value_is_nil (pair->value))
+    table->count++;
+
+  pair->key = key;
+  pair->value = value;
+  return is_new;
+}
+
+bool
+old_table_remove (old_table_t *table, string_t *key)
+{
+  if (table->count == 0)
+    return false;
+
+  pair_t *pair = old_table_get (table, key);
+  if (pair->key == NULL)
+    return false;
+
+  pair->key = NULL;
+  pair->value = value_from_boolean (true);
+  return true;
+}
+
+void
+old_table_free (old_table_t *table)
+{
+  free (table->pairs);
+}
+
+/* KEYS */
+
+/* keys are made outside the vm's heap, hashed the way interned strings
+   are, so no collection moves or frees them while they're timed */
+string_t *
+key_new (const char *prefix, int n)
+{
+  char chars[32];
+  int length = snprintf (chars, sizeof chars, "%s%d", prefix, n);
+  string_t *s = malloc (sizeof (string_t) + length + 1);
+  if (s == NULL)
+    exit (1);
+  memcpy (s->chars, chars, length + 1);
+  s->length = length;
+  s->hash = hash_from_string (chars, length);
+  s->hashed = true;
+  s->interned = true;
+  return s;
+}
+
+/* TIMING */
+
+typedef enum
+{
+  TIME_INSERT,
+  TIME_GET,
+  TIME_FIND_HIT,
+  TIME_FIND_MISS,
+  TIME_REMOVE_SET,
+  TIME_COUNT,
+} measure_t;
+
+double
+now ()
+{
+  struct timespec t;
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* the sums keep the lookups from being optimized away */
+volatile uintptr_t sink;
+
+/* one run of each measurement on a table of n keys, in ns per operation */
+void
+time_old (string_t **keys, string_t **misses, int n, int passes,
+          double *ns)
+{
+  uintptr_t sum = 0;
+  old_table_t table;
+
+  double start = now ();
+  for (int p = 0; p < passes; p++)
+    {
+      old_table_new (&table);
+      for (int i = 0; i < n; i++)
+        old_table_set (&table, keys[i], value_nil ());
+      if (p + 1 < passes)
+        old_table_free (&table);
+    }
+  ns[TIME_INSERT] = (now () - start) / ((double)n * passes);
+
+  start = now ();
+  for (int p = 0; p < passes; p++)
+    for (int i = 0; i < n; i++)
+      sum += (uintptr_t)old_table_get (&table, keys[i]);
+  ns[TIME_GET] = (now () - start) / ((double)n * passes);
+
+  start = now ();
+  for (int p = 0; p < passes; p++)
+    for (int i = 0; i < n; i++)
+      sum += (uintptr_t)old_table_find_string (
+          &table, keys[i]->chars, keys[i]->length, "", 0, keys[i]->hash);
+  ns[TIME_FIND_HIT] = (now () - start) / ((double)n * passes);
+
+  start = now ();
+  for (int p = 0; p < passes; p++)
+    for (int i = 0; i < n; i++)
+      sum += (uintptr_t)old_table_find_string (&table, misses[i]->chars,
+                                               misses[i]->length, "", 0,
+                                               misses[i]->hash);
+  ns[TIME_FIND_MISS] = (now () - start) / ((double)n * passes);
+
+  start = now ();
+  for (int p = 0; p < passes; p++)
+    for (int i = 0; i < n; i++)
+      {
+        old_table_remove (&table, keys[i]);
+        old_table_set (&table, keys[i], value_nil ());
+      }
+  ns[TIME_REMOVE_SET] = (now () - start) / ((double)n * passes);
+
+  old_table_free (&table);
+  sink = sum;
+}
+
+void
+time_new (string_t **keys, string_t **misses, int n, int passes,
+          double *ns)
+{
+  uintptr_t sum = 0;
+  table_t table;
+
+  double start = now ();
+  for (int p = 0; p < passes; p++)
+    {
+      table_new (&table);
+      for (int i = 0; i < n; i++)
+        table_set (&table, keys[i], value_nil ());
+      if (p + 1 < passes)
+        table_free (&table);
+    }
+  ns[TIME_INSERT] = (now () - start) / ((double)n * passes);
+
+  start = now ();
+  for (int p = 0; p < passes; p++)
+    for (int i = 0; i < n; i++)
+      sum += (uintptr_t)table_get (&table, keys[i]);
+  ns[TIME_GET] = (now () - start) / ((double)n * passes);
+
+  start = now ();
+  for (int p = 0; p < passes; p++)
+    for (int i = 0; i < n; i++)
+      sum += (uintptr_t)table_find_string (
+          &table, keys[i]->chars, keys[i]->length, "", 0, keys[i]->hash);
+  ns[TIME_FIND_HIT] = (now () - start) / ((double)n * passes);
+
+  start = now ();
+  for (int p = 0; p < passes; p++)
+    for (int i = 0; i < n; i++)
+      sum += (uintptr_t)table_find_string (&table, misses[i]->chars,
+                                           misses[i]->length, "", 0,
+                                           misses[i]->hash);
+  ns[TIME_FIND_MISS] = (now () - start) / ((double)n * passes);
+
+  start = now ();
+  for (int p = 0; p < passes; p++)
+    for (int i = 0; i < n; i++)
+      {
+        table_remove (&table, keys[i]);
+        table_set (&table, keys[i], value_nil ());
+      }
+  ns[TIME_REMOVE_SET] = (now () - start) / ((double)n * passes);
+
+  table_free (&table);
+  sink = sum;
+}
+
+int
+main ()
+{
+  const char *names[TIME_COUNT]
+      = { "insert", "get", "find hit", "find miss", "remove+set" };
+
+  printf ("%-6s", "keys");
+  for (int m = 0; m < TIME_COUNT; m++)
+    printf ("  %16s", names[m]);
+  printf ("\n");
+
+  for (int bits = 8; bits <= 20; bits += 4)
+    {
+      int n = 1 << bits;
+      int passes = n < MIN_OPS ? MIN_OPS / n : 1;
+      string_t **keys = malloc (n * sizeof (string_t *));
+      string_t **misses = malloc (n * sizeof (string_t *));
+      if (keys == NULL || misses == NULL)
+        exit (1);
+      for (int i = 0; i < n; i++)
+        {
+          keys[i] = key_new ("k", i);
+          misses[i] = key_new ("m", i);
+        }
+
+      double best_old[TIME_COUNT], best_new[TIME_COUNT], ns[TIME_COUNT];
+      for (int m = 0; m < TIME_COUNT; m++)
+        best_old[m] = best_new[m] = INFINITY;
+      for (int run = 0; run < RUNS; run++)
+        {
+          time_old (keys, misses, n, passes, ns);
+          for (int m = 0; m < TIME_COUNT; m++)
+            best_old[m] = fmin (best_old[m], ns[m]);
+          time_new (keys, misses, n, passes, ns);
+          for (int m = 0; m < TIME_COUNT; m++)
+            best_new[m] = fmin (best_new[m], ns[m]);
+        }
+
+      printf ("2^%-4d", bits);
+      for (int m = 0; m < TIME_COUNT; m++)
+        printf ("  %7.1f -> %5.1f", best_old[m], best_new[m]);
+      printf ("\n");
+
+      for (int i = 0; i < n; i++)
+        {
+          free (keys[i]);
+          free (misses[i]);
+        }
+      free (keys);
+      free (misses);
+    }
+  return 0;
+}
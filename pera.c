@@ -1,15 +1,51 @@
+#include <limits.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-#define DEBUG
-#define FRAMES_MAX 64
-#define STACK_SIZE (FRAMES_MAX * 256)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// #define NAN_BOXING
+#define FRAMES_INITIAL 16
+#define FRAMES_MAX (1 << 16)
+/* in values */
+#define STACK_INITIAL 256
+#define STACK_MAX (1 << 22)
+/* room above a frame for values the vm pushes to keep them rooted */
+#define STACK_HEADROOM 8
 #define UINT8_OVER 256
 #define TABLE_LOAD 0.75
+#define TABLE_GROUP 16
+#define TABLE_EMPTY ((int8_t)-128)
+#define TABLE_DELETED ((int8_t)-2)
+// #define GC_STRESS
+#define GC_HEAP_INITIAL (1024 * 1024)
+#define GC_HEAP_GROW 2
+#define GC_NURSERY_SIZE (256 * 1024)
+#define GC_STEP_BUDGET 256
+#define ROPE_MIN_LENGTH 64
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define SLAB_CLASS_SIZE 16
+#define SLAB_CLASSES 16
+
+/* dispatch through a jump table of label addresses where the compiler
+   supports it, otherwise through the switch in run () */
+#if defined(__GNUC__) && !defined(NO_THREADED_DISPATCH)
+#define THREADED_DISPATCH
+#endif
+
+/* probe table groups with SSE2 where it's available, otherwise a byte at a
+   time */
+#if defined(__SSE2__) && !defined(NO_SIMD_TABLE)
+#include <emmintrin.h>
+#define TABLE_SSE2
+#endif
 
 typedef enum
 {
@@ -24,14 +60,32 @@ typedef enum
   OBJECT_STRING,
   OBJECT_FUNCTION,
   OBJECT_CLOSURE,
+  OBJECT_ROPE,
+  OBJECT_UPVALUE,
 } object_type_t;
 
 typedef struct object
 {
   object_type_t type;
+  /* marked in the cycle whose epoch this matches */
+  uint8_t mark;
+  bool remembered;
+  /* old objects: the next in vm.objects; young ones: where they were
+     copied to, or NULL */
   struct object *next;
 } object_t;
 
+#ifdef NAN_BOXING
+/* numbers are stored as plain doubles, everything else lives in the payload
+   of a quiet NaN: objects set the sign bit, nil and booleans use low tags */
+typedef uint64_t value_t;
+
+#define NAN_QUIET ((uint64_t)0x7ffc000000000000)
+#define NAN_SIGN ((uint64_t)0x8000000000000000)
+#define NAN_TAG_NIL 1
+#define NAN_TAG_FALSE 2
+#define NAN_TAG_TRUE 3
+#else
 typedef struct
 {
   value_type_t type;
@@ -42,6 +96,7 @@ typedef struct
     object_t *object;
   } as;
 } value_t;
+#endif
 
 typedef struct
 {
@@ -50,20 +105,64 @@ typedef struct
   value_t *values;
 } array_t;
 
+typedef struct arena_chunk
+{
+  struct arena_chunk *next;
+  size_t capacity;
+  size_t used;
+  char data[];
+} arena_chunk_t;
+
+/* memory handed out in order and given back all at once */
+typedef struct
+{
+  arena_chunk_t *chunks;
+} arena_t;
+
+typedef struct slab_free
+{
+  struct slab_free *next;
+} slab_free_t;
+
+/* inline cache for one call site: the closure it called last time and
+   where that closure's code starts */
+typedef struct
+{
+  object_t *callee;
+  uint8_t *entry;
+} call_cache_t;
+
 typedef struct
 {
   int length;
   int capacity;
   uint8_t *code;
   array_t constants;
+  /* open addressed index into constants, holding i + 1 or 0 when empty */
+  int *constant_index;
+  int index_capacity;
+  call_cache_t *caches;
+  int cache_count;
+  int cache_capacity;
 } block_t;
 
+typedef struct
+{
+  int length;
+  int capacity;
+  uint8_t *code;
+  int frame_size;
+} reg_block_t;
+
 typedef struct
 {
   object_t object;
   int length;
+  /* strings made by the vm are hashed and interned only once needed */
   uint32_t hash;
-  char *chars;
+  bool hashed;
+  bool interned;
+  char chars[];
 } string_t;
 
 typedef enum
@@ -72,31 +171,76 @@ typedef enum
   FUNCTION_USER_DEFINED,
 } function_type_t;
 
+/* where a closure takes an upvalue from: a local of the enclosing function
+   or one of the enclosing closure's own upvalues */
+typedef struct
+{
+  uint8_t index;
+  bool is_local;
+} capture_t;
+
 typedef struct
 {
   object_t object;
   int arity;
   block_t block;
+  reg_block_t reg;
   string_t *name;
+  capture_t *captures;
+  int upvalue_count;
+  /* the most values a frame of it holds above its slots, in either vm */
+  int stack_size;
+  /* loaded from a bytecode image: its code and captures live in the
+     mapping and aren't freed with it */
+  bool mapped;
 } function_t;
 
+/* a captured variable. while its frame is live it's open and points at the
+   stack slot; once the slot goes away the value moves into closed */
+typedef struct upvalue
+{
+  object_t object;
+  value_t *location;
+  value_t closed;
+  /* the next open upvalue, lower on the stack */
+  struct upvalue *next_open;
+} upvalue_t;
+
 typedef struct
 {
   object_t object;
   function_t *function;
+  int upvalue_count;
+  upvalue_t *upvalues[];
 } closure_t;
 
+/* a concatenation that hasn't been copied yet. left and right are strings
+   or ropes; once flattened, left is the interned string and right NULL */
+typedef struct
+{
+  object_t object;
+  int length;
+  object_t *left;
+  object_t *right;
+} rope_t;
+
 typedef struct
 {
   string_t *key;
   value_t value;
 } pair_t;
 
+/* open addressed in groups of TABLE_GROUP pairs, with a control byte per
+   pair that is TABLE_EMPTY, TABLE_DELETED or the low bits of its key's hash,
+   so a whole group is checked at once before any key is looked at */
 typedef struct
 {
   object_t object;
   int count;
+  /* live and deleted pairs, which both lengthen probes */
+  int used;
   int capacity;
+  int8_t *controls;
   pair_t *pairs;
 } table_t;
 
@@ -128,9 +272,55 @@ typedef enum
   OP_CLOSURE,
   OP_CALL,
   OP_RETURN,
+  OP_SET_LOCAL_POP,
+  OP_ADD_LOCALS,
+  OP_ADD_LOCAL_CONSTANT,
+  OP_JUMP_IF_FALSE_POP,
+  OP_JUMP_IF_TRUE_POP,
+  OP_GET_UPVALUE,
+  OP_CLOSE,
+  OP_TAIL_CALL,
   OP_NOT_BUILTIN,
 } opcode_t;
 
+/* register instructions name frame slots directly: 'a' is the destination,
+   'b' and 'c' are sources and 'k' indexes the constant pool */
+typedef enum
+{
+  ROP_MOVE,          // a b
+  ROP_LOADK,         // a k
+  ROP_NIL,           // a
+  ROP_TRUE,          // a
+  ROP_FALSE,         // a
+  ROP_SET_GLOBAL,    // g16 a
+  ROP_GET_GLOBAL,    // a g16
+  ROP_NEG,           // a b
+  ROP_NOT,           // a b
+  ROP_ADD,           // a b c
+  ROP_SUB,           // a b c
+  ROP_MUL,           // a b c
+  ROP_DIV,           // a b c
+  ROP_MOD,           // a b c
+  ROP_EQ,            // a b c
+  ROP_CONCAT,        // a b c
+  ROP_ADDK,          // a b k
+  ROP_SUBK,          // a b k
+  ROP_MULK,          // a b k
+  ROP_DIVK,          // a b k
+  ROP_MODK,          // a b k
+  ROP_EQK,           // a b k
+  ROP_PRINT,         // a
+  ROP_LOOP,          // offset
+  ROP_JUMP,          // offset
+  ROP_JUMP_IF_FALSE, // a offset
+  ROP_GET_UPVALUE,   // a u
+  ROP_CLOSE,         // a
+  ROP_CLOSURE,       // a k
+  ROP_CALL,          // a argc c16
+  ROP_TAIL_CALL,     // a argc c16
+  ROP_RETURN,        // a
+} reg_opcode_t;
+
 typedef enum
 {
   RESULT_OK,
@@ -165,6 +355,8 @@ typedef struct
 {
   token_t name;
   int depth;
+  /* read by an inner function, so it's closed over when it goes away */
+  bool captured;
 } local_t;
 
 typedef struct compiler
@@ -175,8 +367,39 @@ typedef struct compiler
   local_t locals[UINT8_OVER];
   int local_count;
   int scope_depth;
+  capture_t upvalues[UINT8_OVER];
+  int upvalue_count;
 } compiler_t;
 
+typedef enum
+{
+  SLOT_REGISTER,
+  SLOT_LOCAL,
+  SLOT_CONSTANT,
+} slot_kind_t;
+
+/* where a stack value lives while translating to register code: in its own
+   register, still in a local's register, or not loaded from a constant yet */
+typedef struct
+{
+  slot_kind_t kind;
+  uint8_t index;
+} slot_t;
+
+typedef struct
+{
+  block_t *block;
+  reg_block_t *reg;
+  slot_t slots[UINT8_OVER];
+  int depth;
+  int *depths;
+  int *offsets;
+  int *jumps;
+  int *targets;
+  int jump_count;
+  int last_dst;
+} translator_t;
+
 typedef struct
 {
   closure_t *closure;
@@ -184,16 +407,61 @@ typedef struct
   value_t *slots;
 } call_t;
 
+typedef enum
+{
+  GC_IDLE,
+  GC_MARK,
+  GC_SWEEP,
+} gc_phase_t;
+
+typedef struct
+{
+  object_t **objects;
+  int count;
+  int capacity;
+} object_stack_t;
+
 typedef struct
 {
-  call_t calls[FRAMES_MAX];
+  /* both stacks grow when a call or a loop needs more room */
+  call_t *calls;
   int call_count;
-  // uint8_t *pc;
-  value_t stack[STACK_SIZE];
+  int call_capacity;
+  value_t *stack;
+  value_t *stack_end;
   value_t *top;
   table_t strings;
+  /* sorted by stack slot, highest first */
+  upvalue_t *open_upvalues;
+  /* maps global names to slots in global_values, resolved at compile time */
   table_t globals;
+  array_t global_values;
+  array_t global_names;
   object_t *objects;
+  size_t bytes_allocated;
+  size_t next_gc;
+  object_stack_t gray;
+  uint8_t epoch;
+  gc_phase_t gc_phase;
+  int global_cursor;
+  /* the heap as it was when incremental marking ended */
+  object_t *sweeping;
+  size_t gc_cycle_start;
+  double gc_max_pause;
+  char *nursery;
+  size_t nursery_used;
+  object_stack_t promoted;
+  /* old objects and global slots that may point into the nursery */
+  object_stack_t remembered;
+  /* free lists of heap objects by size class, carved from slab_arena */
+  slab_free_t *slabs[SLAB_CLASSES];
+  arena_t slab_arena;
+  int *young_globals;
+  int young_global_count;
+  int young_global_capacity;
+  /* the bytecode image loaded functions run from, if any */
+  void *image;
+  size_t image_size;
 } vm_t;
 
 /* GLOBALS */
@@ -201,21 +469,204 @@ typedef struct
 compiler_t *current;
 scan_t scan;
 vm_t vm;
+/* compile time scratch data, reset after each function is finished */
+arena_t scratch;
+bool trace;
+bool use_registers;
+bool stream;
+int frames_initial = FRAMES_INITIAL;
+int stack_initial = STACK_INITIAL;
+bool gc_incremental;
+int gc_budget = GC_STEP_BUDGET;
+
+/* VALUE FUNCTIONS */
+
+#ifdef NAN_BOXING
+
+value_t
+value_nil ()
+{
+  return NAN_QUIET | NAN_TAG_NIL;
+}
+
+value_t
+value_from_boolean (bool b)
+{
+  return NAN_QUIET | (b ? NAN_TAG_TRUE : NAN_TAG_FALSE);
+}
+
+value_t
+value_from_number (double n)
+{
+  value_t v;
+  memcpy (&v, &n, sizeof (double));
+  return v;
+}
+
+value_t
+value_from_object (object_t *o)
+{
+  return NAN_SIGN | NAN_QUIET | (uint64_t)(uintptr_t)o;
+}
+
+bool
+value_is_nil (value_t v)
+{
+  return v == value_nil ();
+}
+
+bool
+value_is_boolean (value_t v)
+{
+  return (v | 1) == (NAN_QUIET | NAN_TAG_TRUE);
+}
+
+bool
+value_is_number (value_t v)
+{
+  return (v & NAN_QUIET) != NAN_QUIET;
+}
+
+bool
+value_is_object (value_t v)
+{
+  return (v & (NAN_QUIET | NAN_SIGN)) == (NAN_QUIET | NAN_SIGN);
+}
+
+bool
+value_as_boolean (value_t v)
+{
+  return v == (NAN_QUIET | NAN_TAG_TRUE);
+}
+
+double
+value_as_number (value_t v)
+{
+  double n;
+  memcpy (&n, &v, sizeof (double));
+  return n;
+}
+
+object_t *
+value_as_object (value_t v)
+{
+  return (object_t *)(uintptr_t)(v & ~(NAN_SIGN | NAN_QUIET));
+}
+
+#else
+
+value_t
+value_nil ()
+{
+  return (value_t){ .type = TYPE_NIL };
+}
+
+value_t
+value_from_boolean (bool b)
+{
+  return (value_t){ .type = TYPE_BOOL, .as.boolean = b };
+}
+
+value_t
+value_from_number (double n)
+{
+  return (value_t){ .type = TYPE_NUMBER, .as.number = n };
+}
+
+value_t
+value_from_object (object_t *o)
+{
+  return (value_t){ .type = TYPE_OBJECT, .as.object = o };
+}
+
+bool
+value_is_nil (value_t v)
+{
+  return v.type == TYPE_NIL;
+}
+
+bool
+value_is_boolean (value_t v)
+{
+  return v.type == TYPE_BOOL;
+}
+
+bool
+value_is_number (value_t v)
+{
+  return v.type == TYPE_NUMBER;
+}
+
+bool
+value_is_object (value_t v)
+{
+  return v.type == TYPE_OBJECT;
+}
+
+bool
+value_as_boolean (value_t v)
+{
+  return v.as.boolean;
+}
+
+double
+value_as_number (value_t v)
+{
+  return v.as.number;
+}
+
+object_t *
+value_as_object (value_t v)
+{
+  return v.as.object;
+}
+
+#endif
+
+bool
+value_is_object_type (value_t v, object_type_t type)
+{
+  return value_is_object (v) && value_as_object (v)->type == type;
+}
+
+bool
+value_to_boolean (value_t v)
+{
+  if (value_is_number (v))
+    return value_as_number (v) != 0;
+  if (value_is_boolean (v))
+    return value_as_boolean (v);
+  return !value_is_nil (v);
+}
 
 /* COMPARE VALUES */
 
+bool string_equals (string_t *a, string_t *b);
+uint32_t string_hash (string_t *s);
+
 bool
 value_objects_are_equal (value_t v1, value_t v2)
 {
-  object_t *o1 = v1.as.object;
-  object_t *o2 = v2.as.object;
+  object_t *o1 = value_as_object (v1);
+  object_t *o2 = value_as_object (v2);
 
-  return o1->type == o2->type && o1 == o2;
+  if (o1 == o2)
+    return true;
+  return o1->type == OBJECT_STRING && o2->type == OBJECT_STRING
+         && string_equals ((string_t *)o1, (string_t *)o2);
 }
 
 bool
 value_are_equal (value_t v1, value_t v2)
 {
+#ifdef NAN_BOXING
+  /* compare numbers as doubles so that 0 == -0 and NaN != NaN */
+  if (value_is_number (v1) && value_is_number (v2))
+    return value_as_number (v1) == value_as_number (v2);
+  if (value_is_object (v1) && value_is_object (v2))
+    return value_objects_are_equal (v1, v2);
+  return v1 == v2;
+#else
   if (v1.type != v2.type)
     return false;
 
@@ -230,6 +681,32 @@ value_are_equal (value_t v1, value_t v2)
     case TYPE_OBJECT:
       return value_objects_are_equal (v1, v2);
     }
+#endif
+}
+
+/* hash so that values equal under value_are_equal hash the same */
+uint32_t
+value_hash (value_t v)
+{
+  uint64_t bits = 0;
+  if (value_is_number (v))
+    {
+      double n = value_as_number (v);
+      if (n == 0)
+        n = 0; /* -0 */
+      memcpy (&bits, &n, sizeof (double));
+    }
+  else if (value_is_object_type (v, OBJECT_STRING))
+    bits = string_hash ((string_t *)value_as_object (v));
+  else if (value_is_object (v))
+    bits = (uint64_t)(uintptr_t)value_as_object (v);
+  else if (value_is_boolean (v))
+    bits = value_as_boolean (v) + 1;
+
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdull;
+  bits ^= bits >> 33;
+  return (uint32_t)bits;
 }
 
 /* ARRAY FUNCTIONS */
@@ -258,22 +735,118 @@ array_push (array_t *array, value_t value)
   array->length++;
 }
 
+void
+array_free (array_t *array)
+{
+  free (array->values);
+}
+
+/* ARENA FUNCTIONS */
+
+void *
+arena_alloc (arena_t *arena, size_t size)
+{
+  size = (size + 7) & ~(size_t)7;
+
+  arena_chunk_t *chunk = arena->chunks;
+  if (chunk == NULL || chunk->used + size > chunk->capacity)
+    {
+      size_t capacity = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+      chunk = malloc (sizeof (arena_chunk_t) + capacity);
+      if (chunk == NULL)
+        exit (1);
+      chunk->capacity = capacity;
+      chunk->used = 0;
+      chunk->next = arena->chunks;
+      arena->chunks = chunk;
+    }
+
+  void *p = chunk->data + chunk->used;
+  chunk->used += size;
+  return p;
+}
+
+void *
+arena_calloc (arena_t *arena, size_t size)
+{
+  void *p = arena_alloc (arena, size);
+  memset (p, 0, size);
+  return p;
+}
+
+/* keep the newest chunk around for the next round */
+void
+arena_reset (arena_t *arena)
+{
+  arena_chunk_t *chunk = arena->chunks;
+  if (chunk == NULL)
+    return;
+
+  arena_chunk_t *next = chunk->next;
+  while (next != NULL)
+    {
+      arena_chunk_t *n = next->next;
+      free (next);
+      next = n;
+    }
+  chunk->next = NULL;
+  chunk->used = 0;
+}
+
+void
+arena_free (arena_t *arena)
+{
+  arena_reset (arena);
+  free (arena->chunks);
+  arena->chunks = NULL;
+}
+
+/* SLAB FUNCTIONS */
+
 int
-array_find (array_t *array, value_t value)
+slab_class (size_t size)
 {
-  for (int i = 0; i < array->length; i++)
+  return (size + SLAB_CLASS_SIZE - 1) / SLAB_CLASS_SIZE - 1;
+}
+
+void *
+slab_alloc (size_t size)
+{
+  int class = slab_class (size);
+  if (class >= SLAB_CLASSES)
+    return malloc (size);
+
+  if (vm.slabs[class] == NULL)
     {
-      value_t array_value = array->values[i];
-      if (value_are_equal (value, array_value))
-        return i;
+      size_t slot = (class + 1) * SLAB_CLASS_SIZE;
+      int count = ARENA_CHUNK_SIZE / 4 / slot;
+      char *chunk = arena_alloc (&vm.slab_arena, count * slot);
+      for (int i = count - 1; i >= 0; i--)
+        {
+          slab_free_t *f = (slab_free_t *)(chunk + i * slot);
+          f->next = vm.slabs[class];
+          vm.slabs[class] = f;
+        }
     }
-  return -1;
+
+  slab_free_t *f = vm.slabs[class];
+  vm.slabs[class] = f->next;
+  return f;
 }
 
 void
-array_free (array_t *array)
+slab_release (void *p, size_t size)
 {
-  free (array->values);
+  int class = slab_class (size);
+  if (class >= SLAB_CLASSES)
+    {
+      free (p);
+      return;
+    }
+
+  slab_free_t *f = p;
+  f->next = vm.slabs[class];
+  vm.slabs[class] = f;
 }
 
 /* BLOCK FUNCTIONS */
@@ -285,6 +858,11 @@ block_new (block_t *block)
   block->capacity = 8;
   block->code = malloc (8 * sizeof (uint8_t));
   array_new (&block->constants);
+  block->constant_index = NULL;
+  block->index_capacity = 0;
+  block->caches = NULL;
+  block->cache_count = 0;
+  block->cache_capacity = 0;
 }
 
 block_t *
@@ -309,15 +887,59 @@ block_push (uint8_t byte)
   block->length++;
 }
 
+int *
+block_find_constant (block_t *block, value_t value)
+{
+  uint32_t mask = block->index_capacity - 1;
+  uint32_t i = value_hash (value) & mask;
+
+  while (1)
+    {
+      int *entry = &block->constant_index[i];
+      if (*entry == 0
+          || value_are_equal (block->constants.values[*entry - 1], value))
+        return entry;
+      i = (i + 1) & mask;
+    }
+}
+
+void
+block_grow_constant_index (block_t *block)
+{
+  int *old_index = block->constant_index;
+  int old_capacity = block->index_capacity;
+
+  block->index_capacity = old_capacity == 0 ? 16 : old_capacity * 2;
+  block->constant_index = calloc (block->index_capacity, sizeof (int));
+  if (block->constant_index == NULL)
+    exit (1);
+
+  for (int i = 0; i < old_capacity; i++)
+    if (old_index[i] != 0)
+      {
+        value_t v = block->constants.values[old_index[i] - 1];
+        *block_find_constant (block, v) = old_index[i];
+      }
+
+  free (old_index);
+}
+
+void gc_write_barrier (object_t *owner, value_t v);
+
 int
 block_add_constant (value_t value)
 {
   block_t *block = get_block ();
-  int i = array_find (&block->constants, value);
-  if (i >= 0)
-    return i;
+  if (block->constants.length + 1 > block->index_capacity * TABLE_LOAD)
+    block_grow_constant_index (block);
+
+  int *entry = block_find_constant (block, value);
+  if (*entry != 0)
+    return *entry - 1;
 
   array_push (&block->constants, value);
+  gc_write_barrier ((object_t *)current->function, value);
+  *entry = block->constants.length;
   return block->constants.length - 1;
 }
 
@@ -335,131 +957,445 @@ block_push_constant (value_t value, opcode_t op)
   block_push (constant);
 }
 
-void
-block_free (block_t *block)
+int
+block_add_call_cache ()
 {
-  free (block->code);
-  array_free (&block->constants);
-}
+  block_t *block = get_block ();
+  if (block->cache_count > UINT16_MAX)
+    {
+      fprintf (stderr, "Too many calls in block.\n");
+      exit (1);
+    }
 
-/* TABLE FUNCTIONS */
+  if (block->cache_capacity < block->cache_count + 1)
+    {
+      block->cache_capacity
+          = block->cache_capacity == 0 ? 8 : block->cache_capacity * 2;
+      block->caches = realloc (block->caches,
+                               block->cache_capacity * sizeof (call_cache_t));
+      if (block->caches == NULL)
+        exit (1);
+    }
+
+  block->caches[block->cache_count] = (call_cache_t){ NULL, NULL };
+  return block->cache_count++;
+}
 
+/* a finished function's block won't grow again: give back the spare code
+   capacity and the index only used to dedupe constants while compiling */
 void
-table_fill_null_pairs (pair_t *pairs, int capacity)
+block_finish (block_t *block)
 {
-  for (int i = 0; i < capacity; i++)
+  if (block->length > 0 && block->length < block->capacity)
     {
-      pairs[i].key = NULL;
-      pairs[i].value = (value_t){ .type = TYPE_NIL };
+      uint8_t *code = realloc (block->code, block->length);
+      if (code != NULL)
+        {
+          block->code = code;
+          block->capacity = block->length;
+        }
     }
+
+  free (block->constant_index);
+  block->constant_index = NULL;
+  block->index_capacity = 0;
 }
 
 void
-table_new (table_t *table)
+block_free (block_t *block)
 {
-  table->count = 0;
-  table->capacity = 8;
-  table->pairs = malloc (8 * sizeof (pair_t));
-  table_fill_null_pairs (table->pairs, table->capacity);
+  free (block->code);
+  array_free (&block->constants);
+  free (block->constant_index);
+  free (block->caches);
 }
 
-pair_t *
+int
+op_length (uint8_t op)
+{
+  switch (op)
+    {
+    case OP_CONSTANT:
+    case OP_SET_LOCAL:
+    case OP_GET_LOCAL:
+    case OP_END_SCOPE:
+    case OP_CLOSURE:
+    case OP_SET_LOCAL_POP:
+    case OP_GET_UPVALUE:
+    case OP_CLOSE:
+      return 2;
+    case OP_SET_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_LOOP:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_ADD_LOCALS:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_JUMP_IF_FALSE_POP:
+    case OP_JUMP_IF_TRUE_POP:
+      return 3;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      return 4;
+    default:
+      return 1;
+    }
+}
+
+/* how many values an instruction leaves on the stack, less the ones it
+   takes. a call's frame is accounted for when it's entered */
+int
+op_stack_effect (uint8_t *code)
+{
+  switch (code[0])
+    {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_CONSTANT:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_CLOSURE:
+    case OP_ADD_LOCALS:
+    case OP_ADD_LOCAL_CONSTANT:
+      return 1;
+    case OP_SET_GLOBAL:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_EQ:
+    case OP_CONCAT:
+    case OP_PRINT:
+    case OP_POP:
+    case OP_SET_LOCAL_POP:
+    case OP_JUMP_IF_FALSE_POP:
+    case OP_JUMP_IF_TRUE_POP:
+      return -1;
+    case OP_END_SCOPE:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      return -code[1];
+    default:
+      return 0;
+    }
+}
+
+bool
+op_is_jump (uint8_t op)
+{
+  return op == OP_LOOP || op == OP_JUMP || op == OP_JUMP_IF_FALSE
+         || op == OP_JUMP_IF_FALSE_POP || op == OP_JUMP_IF_TRUE_POP;
+}
+
+int
+op_jump_target (block_t *block, int offset)
+{
+  uint16_t jump = (block->code[offset + 1] << 8) | block->code[offset + 2];
+  if (block->code[offset] == OP_LOOP)
+    return offset + 3 - jump;
+  return offset + 3 + jump;
+}
+
+/* REGISTER BLOCK FUNCTIONS */
+
+void
+reg_block_new (reg_block_t *reg)
+{
+  reg->length = 0;
+  reg->capacity = 0;
+  reg->code = NULL;
+  reg->frame_size = 0;
+}
+
+void
+reg_push (reg_block_t *reg, uint8_t byte)
+{
+  if (reg->capacity < reg->length + 1)
+    {
+      reg->capacity = reg->capacity < 8 ? 8 : reg->capacity * 2;
+      reg->code = realloc (reg->code, reg->capacity * sizeof (uint8_t));
+      if (reg->code == NULL)
+        exit (1);
+    }
+
+  reg->code[reg->length] = byte;
+  reg->length++;
+}
+
+/* the operands of each instruction are listed in reg_opcode_t */
+int
+reg_op_length (uint8_t op)
+{
+  switch (op)
+    {
+    case ROP_NIL:
+    case ROP_TRUE:
+    case ROP_FALSE:
+    case ROP_PRINT:
+    case ROP_CLOSE:
+    case ROP_RETURN:
+      return 2;
+    case ROP_MOVE:
+    case ROP_LOADK:
+    case ROP_NEG:
+    case ROP_NOT:
+    case ROP_LOOP:
+    case ROP_JUMP:
+    case ROP_GET_UPVALUE:
+    case ROP_CLOSURE:
+      return 3;
+    case ROP_CALL:
+    case ROP_TAIL_CALL:
+      return 5;
+    default:
+      return 4;
+    }
+}
+
+void
+reg_block_free (reg_block_t *reg)
+{
+  free (reg->code);
+}
+
+/* TABLE FUNCTIONS */
+
+#ifdef TABLE_SSE2
+
+uint32_t
+table_match (int8_t *group, int8_t control)
+{
+  __m128i bytes = _mm_loadu_si128 ((const __m128i *)group);
+  return _mm_movemask_epi8 (_mm_cmpeq_epi8 (bytes, _mm_set1_epi8 (control)));
+}
+
+/* empty and deleted control bytes are the ones with the high bit set */
+uint32_t
+table_match_free (int8_t *group)
+{
+  return _mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *)group));
+}
+
+#else
+
+uint32_t
+table_match (int8_t *group, int8_t control)
+{
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP; i++)
+    if (group[i] == control)
+      mask |= 1u << i;
+  return mask;
+}
+
+uint32_t
+table_match_free (int8_t *group)
+{
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP; i++)
+    if (group[i] < 0)
+      mask |= 1u << i;
+  return mask;
+}
+
+#endif
+
+int
+table_first_match (uint32_t mask)
+{
+#ifdef __GNUC__
+  return __builtin_ctz (mask);
+#else
+  int i = 0;
+  for (; (mask & 1) == 0; mask >>= 1)
+    i++;
+  return i;
+#endif
+}
+
+/* the low 7 bits of a hash are kept in the control byte, the rest pick the
+   first group to probe */
+int8_t
+table_control (uint32_t hash)
+{
+  return hash & 0x7f;
+}
+
+void
+table_allocate (table_t *table, int capacity)
+{
+  table->count = 0;
+  table->used = 0;
+  table->capacity = capacity;
+  /* the control bytes follow the pairs in the same allocation */
+  table->pairs = malloc (capacity * (sizeof (pair_t) + 1));
+  if (table->pairs == NULL)
+    exit (1);
+  table->controls = (int8_t *)(table->pairs + capacity);
+  memset (table->controls, (uint8_t)TABLE_EMPTY, capacity);
+}
+
+void
+table_new (table_t *table)
+{
+  table_allocate (table, TABLE_GROUP);
+}
+
+/* groups are probed at triangular offsets, which visit every group once
+   the group count is a power of two */
+pair_t *
 table_get (table_t *table, string_t *key)
 {
-  uint32_t i = key->hash % table->capacity;
-  pair_t *dead = NULL;
+  uint32_t groups = table->capacity / TABLE_GROUP - 1;
+  int8_t control = table_control (key->hash);
 
-  while (1)
+  for (uint32_t g = (key->hash >> 7) & groups, step = 1;;
+       g = (g + step++) & groups)
     {
-      pair_t *pair = &table->pairs[i];
-      if (pair->key == NULL)
-        {
-          /* check for empty pair */
-          if (pair->value.type == TYPE_NIL)
-            return dead == NULL ? pair : dead;
-          /* else it's a dead pair */
-          else if (dead == NULL)
-            dead = pair;
-        }
-      else if (pair->key == key)
+      int8_t *group = &table->controls[g * TABLE_GROUP];
+      for (uint32_t m = table_match (group, control); m != 0; m &= m - 1)
         {
-          return pair;
+          pair_t *pair
+              = &table->pairs[g * TABLE_GROUP + table_first_match (m)];
+          if (pair->key == key)
+            return pair;
         }
-      i = (i + 1) % table->capacity;
+      /* a key is never placed past a group that still has room */
+      if (table_match (group, TABLE_EMPTY) != 0)
+        return NULL;
     }
 }
 
+/* the characters may come in two pieces, as for a concatenation that
+   hasn't been allocated yet */
 bool
-table_key_equals_string (pair_t *p, string_t *s)
+table_key_equals_chars (pair_t *p, const char *a, int len_a, const char *b,
+                        int len_b, uint32_t hash)
 {
-  return p->key->length == s->length && p->key->hash == s->hash
-         && memcmp (p->key->chars, s->chars, s->length) == 0;
+  string_t *key = p->key;
+  return key->length == len_a + len_b && key->hash == hash
+         && memcmp (key->chars, a, len_a) == 0
+         && memcmp (key->chars + len_a, b, len_b) == 0;
 }
 
 string_t *
-table_find_string (table_t *table, string_t *string)
+table_find_string (table_t *table, const char *a, int len_a, const char *b,
+                   int len_b, uint32_t hash)
 {
   if (table->count == 0)
     return NULL;
 
-  uint32_t i = string->hash % table->capacity;
-  while (1)
+  uint32_t groups = table->capacity / TABLE_GROUP - 1;
+  int8_t control = table_control (hash);
+
+  for (uint32_t g = (hash >> 7) & groups, step = 1;; g = (g + step++) & groups)
     {
-      pair_t *pair = &table->pairs[i];
-      if (pair->key == NULL)
-        {
-          /* check for empty pair */
-          if (pair->value.type == TYPE_NIL)
-            return NULL;
-        }
-      else if (table_key_equals_string (pair, string))
+      int8_t *group = &table->controls[g * TABLE_GROUP];
+      for (uint32_t m = table_match (group, control); m != 0; m &= m - 1)
         {
-          return pair->key;
+          pair_t *pair
+              = &table->pairs[g * TABLE_GROUP + table_first_match (m)];
+          if (table_key_equals_chars (pair, a, len_a, b, len_b, hash))
+            return pair->key;
         }
-      i = (i + 1) % table->capacity;
+      if (table_match (group, TABLE_EMPTY) != 0)
+        return NULL;
     }
 }
 
-void
-table_grow (table_t *table)
+/* the first empty or deleted pair along the hash's probe sequence */
+int
+table_find_free (table_t *table, uint32_t hash)
 {
-  int new_capacity = table->capacity * 2;
-  pair_t *new_pairs = malloc (new_capacity * sizeof (pair_t));
-  table_fill_null_pairs (new_pairs, new_capacity);
+  uint32_t groups = table->capacity / TABLE_GROUP - 1;
 
-  table->count = 0;
-  for (int i = 0; i < table->capacity; i++)
+  for (uint32_t g = (hash >> 7) & groups, step = 1;; g = (g + step++) & groups)
     {
-      pair_t *pair = &table->pairs[i];
-      if (pair->key == NULL)
-        continue;
+      uint32_t m = table_match_free (&table->controls[g * TABLE_GROUP]);
+      if (m != 0)
+        return g * TABLE_GROUP + table_first_match (m);
+    }
+}
 
-      pair_t *dest_pair = table_get (table, pair->key);
-      dest_pair->key = pair->key;
-      dest_pair->value = pair->value;
+void
+table_insert_at (table_t *table, int i, string_t *key, value_t value)
+{
+  if (table->controls[i] == TABLE_EMPTY)
+    table->used++;
+  table->controls[i] = table_control (key->hash);
+  table->pairs[i].key = key;
+  table->pairs[i].value = value;
+  table->count++;
+}
 
-      table->count++;
-    }
+/* move the live pairs into fresh arrays, doubling them unless most of the
+   load was deleted pairs. keys are known to be distinct, so they go
+   straight into free pairs without a lookup */
+void
+table_rehash (table_t *table)
+{
+  int old_capacity = table->capacity;
+  int8_t *old_controls = table->controls;
+  pair_t *old_pairs = table->pairs;
 
-  free (table->pairs);
+  int capacity = old_capacity;
+  if (table->count + 1 > old_capacity * TABLE_LOAD / 2)
+    capacity *= 2;
+  table_allocate (table, capacity);
+
+  for (int i = 0; i < old_capacity; i++)
+    if (old_controls[i] >= 0)
+      {
+        string_t *key = old_pairs[i].key;
+        table_insert_at (table, table_find_free (table, key->hash), key,
+                         old_pairs[i].value);
+      }
 
-  table->capacity = new_capacity;
-  table->pairs = new_pairs;
+  free (old_pairs);
 }
 
+/* one probe both looks for the key and finds where it would go, so a key
+   removed and set again takes its deleted pair back */
 bool
 table_set (table_t *table, string_t *key, value_t value)
 {
-  if (table->count + 1 > table->capacity * TABLE_LOAD)
-    table_grow (table);
-  pair_t *pair = table_get (table, key);
-  bool is_new = pair->key == NULL;
-  if (is_new && pair->value.type == TYPE_NIL)
-    table->count++;
+  uint32_t groups = table->capacity / TABLE_GROUP - 1;
+  int8_t control = table_control (key->hash);
+  int free_pair = -1;
+
+  for (uint32_t g = (key->hash >> 7) & groups, step = 1;;
+       g = (g + step++) & groups)
+    {
+      int8_t *group = &table->controls[g * TABLE_GROUP];
+      for (uint32_t m = table_match (group, control); m != 0; m &= m - 1)
+        {
+          pair_t *pair
+              = &table->pairs[g * TABLE_GROUP + table_first_match (m)];
+          if (pair->key == key)
+            {
+              pair->value = value;
+              return false;
+            }
+        }
+
+      uint32_t free_mask = table_match_free (group);
+      if (free_pair == -1 && free_mask != 0)
+        free_pair = g * TABLE_GROUP + table_first_match (free_mask);
+      if (table_match (group, TABLE_EMPTY) != 0)
+        break;
+    }
 
-  pair->key = key;
-  pair->value = value;
-  return is_new;
+  if (table->controls[free_pair] == TABLE_EMPTY
+      && table->used + 1 > table->capacity * TABLE_LOAD)
+    {
+      table_rehash (table);
+      free_pair = table_find_free (table, key->hash);
+    }
+  table_insert_at (table, free_pair, key, value);
+  return true;
 }
 
 bool
@@ -469,11 +1405,21 @@ table_remove (table_t *table, string_t *key)
     return false;
 
   pair_t *pair = table_get (table, key);
-  if (pair->key == NULL)
+  if (pair == NULL)
     return false;
 
-  pair->key = NULL;
-  pair->value = (value_t){ .type = TYPE_BOOL, .as.boolean = true };
+  /* a group that already has an empty pair ends every probe through it, so
+     the removed pair can be empty too instead of a tombstone */
+  int i = pair - table->pairs;
+  int8_t *group = &table->controls[i & ~(TABLE_GROUP - 1)];
+  if (table_match (group, TABLE_EMPTY) != 0)
+    {
+      table->controls[i] = TABLE_EMPTY;
+      table->used--;
+    }
+  else
+    table->controls[i] = TABLE_DELETED;
+  table->count--;
   return true;
 }
 
@@ -484,100 +1430,213 @@ table_free (table_t *table)
 }
 
 uint32_t
-hash_from_string (const char *string, int length)
+hash_continue (uint32_t hash, const char *string, int length)
 {
-  uint32_t hash = 2166136261u;
   for (int i = 0; i < length; i++)
     hash = (hash ^ (uint8_t)string[i]) * 16777619;
   return hash;
 }
 
+uint32_t
+hash_from_string (const char *string, int length)
+{
+  return hash_continue (2166136261u, string, length);
+}
+
 /* OBJECT FUNCTIONS */
 
 size_t
-object_sizeof (object_type_t type)
+object_sizeof (object_t *o)
 {
-  switch (type)
+  switch (o->type)
     {
     case OBJECT_STRING:
-      return sizeof (string_t);
+      return sizeof (string_t) + ((string_t *)o)->length + 1;
     case OBJECT_FUNCTION:
       return sizeof (function_t);
     case OBJECT_CLOSURE:
-      return sizeof (closure_t);
+      return sizeof (closure_t)
+             + ((closure_t *)o)->upvalue_count * sizeof (upvalue_t *);
+    case OBJECT_ROPE:
+      return sizeof (rope_t);
+    case OBJECT_UPVALUE:
+      return sizeof (upvalue_t);
     }
+  return 0;
 }
 
+void gc_work (bool young, size_t size);
+object_t *gc_nursery_allocate (size_t size);
+bool gc_is_young (object_t *o);
+size_t gc_align (size_t size);
+
 object_t *
-object_new (object_type_t type)
+object_heap_new (object_type_t type, size_t size)
 {
-  size_t size = object_sizeof (type);
+  object_t *o = slab_alloc (size);
+  if (o == NULL)
+    exit (1);
 
-  object_t *o = malloc (size);
+  vm.bytes_allocated += size;
   o->type = type;
+  /* black while marking, live to a running sweep, white to the next cycle */
+  o->mark = vm.epoch;
+  o->remembered = false;
   o->next = vm.objects;
   vm.objects = o;
   return o;
 }
 
+object_t *
+object_new (object_type_t type, size_t size)
+{
+  /* objects made while the vm runs start in the nursery, the ones made by
+     the compiler (functions, literals, names) live long and skip it. so do
+     big strings, which would take most of the nursery to themselves */
+  bool young = vm.call_count > 0 && size <= GC_NURSERY_SIZE / 4;
+
+#ifdef GC_STRESS
+  gc_work (young, size);
+#else
+  if (vm.gc_phase != GC_IDLE
+      || (young ? vm.nursery_used + gc_align (size) > GC_NURSERY_SIZE
+                : vm.bytes_allocated + size > vm.next_gc))
+    gc_work (young, size);
+#endif
+
+  if (young)
+    {
+      object_t *o = gc_nursery_allocate (size);
+      o->type = type;
+      o->remembered = false;
+      o->next = NULL;
+      return o;
+    }
+
+  return object_heap_new (type, size);
+}
+
 /* STRING FUNCTIONS */
 
+bool gc_is_dead (object_t *o);
+
 void
 string_free (string_t *string)
 {
-  // this doesn't remove the string from vm.objects for GC!
-  free (string->chars);
-  free (string);
+  size_t size = object_sizeof ((object_t *)string);
+  vm.bytes_allocated -= size;
+  slab_release (string, size);
 }
 
+/* the characters are stored right after the header, so short strings like
+   names fit a single slab and long ones a single malloc */
 string_t *
-string_new (char *chars, int length)
+string_reserve (int length)
 {
-  string_t *s = (string_t *)object_new (OBJECT_STRING);
+  size_t size = sizeof (string_t) + length + 1;
+  string_t *s = (string_t *)object_new (OBJECT_STRING, size);
 
   s->length = length;
-  s->chars = chars;
-  s->hash = hash_from_string (s->chars, length);
+  s->hashed = false;
+  s->interned = false;
+  s->chars[length] = '\0';
+  return s;
+}
 
-  string_t *interned = table_find_string (&vm.strings, s);
-  if (interned != NULL)
+uint32_t
+string_hash (string_t *s)
+{
+  if (!s->hashed)
     {
-      string_free (s);
-      return interned;
+      s->hash = hash_from_string (s->chars, s->length);
+      s->hashed = true;
     }
+  return s->hash;
+}
 
-  table_set (&vm.strings, s, (value_t){ .type = TYPE_NIL });
-  return s;
+/* two interned strings are equal only if they're the same one */
+bool
+string_equals (string_t *a, string_t *b)
+{
+  if (a == b)
+    return true;
+  if (a->interned && b->interned)
+    return false;
+  return a->length == b->length && string_hash (a) == string_hash (b)
+         && memcmp (a->chars, b->chars, a->length) == 0;
 }
 
+/* look for an interned string without allocating one, so repeated names
+   and concatenations cost nothing once they've been seen */
 string_t *
-string_allocate (char *chars, int length)
+string_find (const char *a, int len_a, const char *b, int len_b,
+             uint32_t hash)
 {
-  char *dest_chars = malloc ((length + 1) * sizeof (char));
-
-  memcpy (dest_chars, chars, length);
-  dest_chars[length] = '\0';
-
-  return string_new (dest_chars, length);
+  string_t *interned
+      = table_find_string (&vm.strings, a, len_a, b, len_b, hash);
+  /* a string the running sweep hasn't freed yet can't be handed out */
+  if (interned != NULL && vm.gc_phase == GC_SWEEP
+      && gc_is_dead ((object_t *)interned))
+    {
+      table_remove (&vm.strings, interned);
+      interned = NULL;
+    }
+  return interned;
 }
 
+/* intern a new string whose characters have been filled in */
 string_t *
-string_concat_and_allocate (char *chars_a, int len_a, char *chars_b, int len_b)
+string_new (string_t *s, uint32_t hash)
 {
-  int length = len_a + len_b;
-  char *dest_chars = malloc ((length + 1) * sizeof (char));
+  s->hash = hash;
+  s->hashed = true;
+  s->interned = true;
+  table_set (&vm.strings, s, value_nil ());
+  return s;
+}
 
-  memcpy (dest_chars, chars_a, len_a);
-  memcpy (dest_chars + len_a, chars_b, len_b);
-  dest_chars[length] = '\0';
+string_t *
+string_allocate (char *chars, int length)
+{
+  uint32_t hash = hash_from_string (chars, length);
+  string_t *interned = string_find (chars, length, "", 0, hash);
+  if (interned != NULL)
+    return interned;
 
-  return string_new (dest_chars, length);
+  string_t *s = string_reserve (length);
+  memcpy (s->chars, chars, length);
+  return string_new (s, hash);
 }
 
+void vm_push (value_t value);
+value_t vm_pop ();
+
+/* the compiler interns the strings it folds; the vm's are left alone until
+   something needs their hash */
 string_t *
-string_copy (char *chars, int length)
+string_concat (string_t *a, string_t *b, bool intern)
 {
-  return string_allocate (chars, length);
+  uint32_t hash = 0;
+  if (intern)
+    {
+      hash = hash_continue (string_hash (a), b->chars, b->length);
+      string_t *interned
+          = string_find (a->chars, a->length, b->chars, b->length, hash);
+      if (interned != NULL)
+        return interned;
+    }
+
+  /* the characters live in the objects, which the allocation can move or
+     free, so keep both on the stack until they're copied */
+  vm_push (value_from_object ((object_t *)a));
+  vm_push (value_from_object ((object_t *)b));
+  string_t *s = string_reserve (a->length + b->length);
+  b = (string_t *)value_as_object (vm_pop ());
+  a = (string_t *)value_as_object (vm_pop ());
+
+  memcpy (s->chars, a->chars, a->length);
+  memcpy (s->chars + a->length, b->chars, b->length);
+  return intern ? string_new (s, hash) : s;
 }
 
 /* FUNCTION FUNCTIONS */
@@ -585,1309 +1644,4806 @@ string_copy (char *chars, int length)
 void
 function_free (function_t *f)
 {
+  vm.bytes_allocated -= sizeof (function_t);
+  if (f->mapped)
+    {
+      f->block.code = NULL;
+      f->reg.code = NULL;
+      f->captures = NULL;
+    }
   block_free (&f->block);
-  free (f);
+  reg_block_free (&f->reg);
+  free (f->captures);
+  slab_release (f, sizeof (function_t));
 }
 
 function_t *
 function_new ()
 {
-  function_t *f = (function_t *)object_new (OBJECT_FUNCTION);
+  function_t *f
+      = (function_t *)object_new (OBJECT_FUNCTION, sizeof (function_t));
 
   f->arity = 0;
   f->name = NULL;
+  f->captures = NULL;
+  f->upvalue_count = 0;
+  f->stack_size = 0;
+  f->mapped = false;
   block_new (&f->block);
+  reg_block_new (&f->reg);
 
   return f;
 }
 
 /* CLOSURE FUNCTIONS */
 
+/* the upvalues start out empty, they're filled in by closure_capture */
 closure_t *
 closure_new (function_t *function)
 {
-  closure_t *closure = (closure_t *)object_new (OBJECT_CLOSURE);
+  int count = function->upvalue_count;
+  size_t size = sizeof (closure_t) + count * sizeof (upvalue_t *);
+  closure_t *closure = (closure_t *)object_new (OBJECT_CLOSURE, size);
   closure->function = function;
+  closure->upvalue_count = count;
+  for (int i = 0; i < count; i++)
+    closure->upvalues[i] = NULL;
+  gc_write_barrier ((object_t *)closure,
+                    value_from_object ((object_t *)function));
   return closure;
 }
 
 void
 closure_free (closure_t *closure)
 {
-  free (closure);
+  size_t size = object_sizeof ((object_t *)closure);
+  vm.bytes_allocated -= size;
+  slab_release (closure, size);
 }
 
-/* GC FUNCTIONS */
+/* UPVALUE FUNCTIONS */
 
 void
-gc_free_object (object_t *object)
+upvalue_free (upvalue_t *upvalue)
 {
-  switch (object->type)
+  vm.bytes_allocated -= sizeof (upvalue_t);
+  slab_release (upvalue, sizeof (upvalue_t));
+}
+
+/* variables captured twice share one upvalue, so both closures see the
+   same value once it's closed */
+upvalue_t *
+upvalue_capture (value_t *slot)
+{
+  upvalue_t **link = &vm.open_upvalues;
+  while (*link != NULL && (*link)->location > slot)
+    link = &(*link)->next_open;
+  if (*link != NULL && (*link)->location == slot)
+    return *link;
+
+  upvalue_t *u = (upvalue_t *)object_new (OBJECT_UPVALUE, sizeof (upvalue_t));
+  u->location = slot;
+  u->closed = value_nil ();
+
+  /* allocating may have moved the upvalues the link was found among */
+  link = &vm.open_upvalues;
+  while (*link != NULL && (*link)->location > slot)
+    link = &(*link)->next_open;
+  u->next_open = *link;
+  *link = u;
+  return u;
+}
+
+/* move the values of slots from last upwards into their upvalues */
+void
+upvalue_close (value_t *last)
+{
+  while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last)
     {
-    case OBJECT_STRING:
-      {
-        string_t *string = (string_t *)object;
-        string_free (string);
-        break;
-      }
-    case OBJECT_FUNCTION:
-      {
-        function_t *function = (function_t *)object;
-        function_free (function);
-        break;
-      }
-    case OBJECT_CLOSURE:
-      {
-        closure_t *closure = (closure_t *)object;
-        closure_free (closure);
-        break;
-      }
+      upvalue_t *u = vm.open_upvalues;
+      u->closed = *u->location;
+      u->location = &u->closed;
+      vm.open_upvalues = u->next_open;
+      u->next_open = NULL;
+      gc_write_barrier ((object_t *)u, u->closed);
     }
 }
 
+/* fill in the upvalues of the closure held in *slot, which keeps it rooted
+   while capturing allocates */
 void
-gc_free_all ()
+closure_capture (value_t *slot, call_t *call)
 {
-  object_t *o = vm.objects;
-  while (o != NULL)
+  function_t *f = ((closure_t *)value_as_object (*slot))->function;
+  for (int i = 0; i < f->upvalue_count; i++)
     {
-      object_t *next = o->next;
-      gc_free_object (o);
-      o = next;
+      capture_t *capture = &f->captures[i];
+      upvalue_t *u = capture->is_local
+                         ? upvalue_capture (call->slots + capture->index)
+                         : call->closure->upvalues[capture->index];
+
+      closure_t *c = (closure_t *)value_as_object (*slot);
+      c->upvalues[i] = u;
+      gc_write_barrier ((object_t *)c, value_from_object ((object_t *)u));
     }
 }
 
-/* COMPILER FUNCTIONS */
+/* ROPE FUNCTIONS */
+
+void object_stack_push (object_stack_t *stack, object_t *o);
+void gc_write_barrier (object_t *owner, value_t v);
 
 void
-compiler_new (compiler_t *compiler, function_type_t type)
+rope_free (rope_t *rope)
 {
-  compiler->outer = current;
-  compiler->function = function_new ();
-  compiler->type = type;
-  compiler->local_count = 0;
-  compiler->scope_depth = 0;
+  vm.bytes_allocated -= sizeof (rope_t);
+  slab_release (rope, sizeof (rope_t));
+}
 
-  local_t *local = &compiler->locals[compiler->local_count++];
-  local->depth = 0;
-  local->name.start = "";
-  local->name.length = 0;
-
-  current = compiler;
+bool
+value_is_text (value_t v)
+{
+  return value_is_object_type (v, OBJECT_STRING)
+         || value_is_object_type (v, OBJECT_ROPE);
 }
 
-function_t *
-compiler_end ()
+/* a flattened rope stands for its string */
+object_t *
+rope_unwrap (object_t *o)
 {
-  block_push (OP_RETURN);
+  if (o->type == OBJECT_ROPE && ((rope_t *)o)->right == NULL)
+    return ((rope_t *)o)->left;
+  return o;
+}
 
-  function_t *f = current->function;
-  current = current->outer;
-  return f;
+int
+text_length (object_t *o)
+{
+  if (o->type == OBJECT_ROPE)
+    return ((rope_t *)o)->length;
+  return ((string_t *)o)->length;
 }
 
-void
-compiler_scope_create ()
+/* short results are copied, and left un-interned until something needs
+   their hash; longer ones only link their halves, so appending to a
+   growing string doesn't copy it again */
+object_t *
+rope_concat (object_t *a, object_t *b)
 {
-  current->scope_depth++;
+  a = rope_unwrap (a);
+  b = rope_unwrap (b);
+  int length = text_length (a) + text_length (b);
+  if (a->type == OBJECT_STRING && b->type == OBJECT_STRING
+      && length < ROPE_MIN_LENGTH)
+    return (object_t *)string_concat ((string_t *)a, (string_t *)b, false);
+
+  vm_push (value_from_object (a));
+  vm_push (value_from_object (b));
+  rope_t *rope = (rope_t *)object_new (OBJECT_ROPE, sizeof (rope_t));
+  rope->right = value_as_object (vm_pop ());
+  rope->left = value_as_object (vm_pop ());
+  rope->length = length;
+  return (object_t *)rope;
 }
 
+/* copy out the characters of a rope, which end at end. pieces are written
+   right to left from a work list, so a long chain of appends doesn't
+   recurse */
 void
-compiler_scope_delete ()
+rope_write (rope_t *rope, char *end)
 {
-  current->scope_depth--;
-
-  uint8_t n = current->local_count;
+  object_stack_t pending = { NULL, 0, 0 };
+  object_stack_push (&pending, (object_t *)rope);
+  while (pending.count > 0)
+    {
+      object_t *o = rope_unwrap (pending.objects[--pending.count]);
+      if (o->type == OBJECT_ROPE)
+        {
+          object_stack_push (&pending, ((rope_t *)o)->left);
+          object_stack_push (&pending, ((rope_t *)o)->right);
+          continue;
+        }
 
-  while (current->local_count > 0
-         && current->locals[current->local_count - 1].depth
-                > current->scope_depth)
-    current->local_count--;
+      string_t *s = (string_t *)o;
+      end -= s->length;
+      memcpy (end, s->chars, s->length);
+    }
+  free (pending.objects);
+}
 
-  n -= current->local_count;
+string_t *
+rope_flatten (rope_t *rope)
+{
+  if (rope->right == NULL)
+    return (string_t *)rope->left;
+
+  int length = rope->length;
+  char *chars = malloc (length);
+  if (chars == NULL)
+    exit (1);
+  rope_write (rope, chars + length);
+
+  vm_push (value_from_object ((object_t *)rope));
+  string_t *s = string_allocate (chars, length);
+  rope = (rope_t *)value_as_object (vm_pop ());
+  free (chars);
+
+  rope->left = (object_t *)s;
+  rope->right = NULL;
+  gc_write_barrier ((object_t *)rope, value_from_object ((object_t *)s));
+  return s;
+}
 
-  if (n > 1)
+/* replace a rope held in a rooted slot with its interned string, before
+   it's compared or printed */
+void
+rope_flatten_value (value_t *v)
+{
+  if (value_is_object_type (*v, OBJECT_ROPE))
     {
-      block_push (OP_END_SCOPE);
-      block_push (n);
+      string_t *s = rope_flatten ((rope_t *)value_as_object (*v));
+      *v = value_from_object ((object_t *)s);
     }
 }
 
-/* VM FUNCTIONS */
+/* GC FUNCTIONS */
 
 void
-vm_new ()
+gc_free_object (object_t *object)
 {
-  vm.top = vm.stack;
-  vm.objects = NULL;
-  vm.call_count = 0;
-  table_new (&vm.strings);
-  table_new (&vm.globals);
+  switch (object->type)
+    {
+    case OBJECT_STRING:
+      {
+        string_t *string = (string_t *)object;
+        string_free (string);
+        break;
+      }
+    case OBJECT_FUNCTION:
+      {
+        function_t *function = (function_t *)object;
+        function_free (function);
+        break;
+      }
+    case OBJECT_CLOSURE:
+      {
+        closure_t *closure = (closure_t *)object;
+        closure_free (closure);
+        break;
+      }
+    case OBJECT_ROPE:
+      {
+        rope_t *rope = (rope_t *)object;
+        rope_free (rope);
+        break;
+      }
+    case OBJECT_UPVALUE:
+      {
+        upvalue_t *upvalue = (upvalue_t *)object;
+        upvalue_free (upvalue);
+        break;
+      }
+    }
 }
 
-void
-vm_free ()
+bool
+gc_is_young (object_t *o)
 {
-  table_free (&vm.strings);
-  table_free (&vm.globals);
-  gc_free_all ();
+  return (uintptr_t)((char *)o - vm.nursery) < GC_NURSERY_SIZE;
 }
 
-void
-vm_reset ()
+bool
+gc_value_is_young (value_t v)
 {
-  current->function->block.length = 0;
-  vm.objects = NULL;
-  vm.top = vm.stack;
+  return value_is_object (v) && gc_is_young (value_as_object (v));
 }
 
-void
-vm_push (value_t value)
+size_t
+gc_align (size_t size)
 {
-  *vm.top = value;
-  vm.top++;
+  return (size + 7) & ~(size_t)7;
 }
 
-value_t
-vm_pop ()
+double
+gc_clock ()
 {
-  vm.top--;
-  return *vm.top;
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-value_t
-vm_peek ()
+void
+object_stack_push (object_stack_t *stack, object_t *o)
 {
-  return *(vm.top - 1);
+  if (stack->capacity < stack->count + 1)
+    {
+      stack->capacity = stack->capacity < 8 ? 8 : stack->capacity * 2;
+      stack->objects
+          = realloc (stack->objects, stack->capacity * sizeof (object_t *));
+      if (stack->objects == NULL)
+        exit (1);
+    }
+  stack->objects[stack->count++] = o;
 }
 
-/* DEBUG */
-
-int
-dbg_disassemble_operation (size_t offset)
+/* free what a young object owns outside the nursery */
+void
+gc_release_young (object_t *o)
 {
-  block_t *block = get_block ();
-  uint8_t constant;
-  value_t value;
-
-  opcode_t op = block->code[offset];
-
-  switch (op)
+  switch (o->type)
     {
-    case OP_NIL:
-      printf ("NIL\n");
-      return 1;
-    case OP_TRUE:
-      printf ("TRUE\n");
-      return 1;
-    case OP_FALSE:
-      printf ("FALSE\n");
-      return 1;
-    case OP_CONSTANT:
-      constant = block->code[offset + 1];
-      value = block->constants.values[constant];
-      printf ("CONSTANT %02x %g\n", constant, value.as.number);
-      return 2;
-    case OP_SET_GLOBAL:
-      printf ("SET GLOBAL\n");
-      return 2;
-    case OP_GET_GLOBAL:
-      printf ("GET GLOBAL\n");
-      return 2;
-    case OP_SET_LOCAL:
-      printf ("SET LOCAL %d\n", block->code[offset + 1]);
-      return 2;
-    case OP_GET_LOCAL:
-      printf ("GET LOCAL %d\n", block->code[offset + 1]);
-      return 2;
-    case OP_NEG:
-      printf ("NEG\n");
-      return 1;
-    case OP_ADD:
-      printf ("ADD\n");
-      return 1;
-    case OP_SUB:
-      printf ("SUB\n");
-      return 1;
-    case OP_MUL:
-      printf ("MUL\n");
-      return 1;
-    case OP_DIV:
-      printf ("DIV\n");
-      return 1;
-    case OP_MOD:
-      printf ("MOD\n");
-      return 1;
-    case OP_NOT:
-      printf ("NOT\n");
-      return 1;
-    case OP_EQ:
-      printf ("EQ\n");
-      return 1;
-    case OP_CONCAT:
-      printf ("CONCAT\n");
-      return 1;
-    case OP_PRINT:
-      printf ("PRINT\n");
-      return 1;
-    case OP_POP:
-      printf ("POP\n");
-      return 1;
-    case OP_LOOP:
-      printf ("LOOP\n");
-      return 3;
-    case OP_JUMP:
-      printf ("JUMP\n");
-      return 3;
-    case OP_JUMP_IF_FALSE:
-      printf ("JUMP IF FALSE\n");
-      return 3;
-    case OP_END_SCOPE:
-      printf ("END SCOPE %d\n", block->code[offset + 1]);
-      return 2;
-    case OP_CLOSURE:
-      printf ("CLOSURE %d\n", block->code[offset + 1]);
-      return 2;
-    case OP_CALL:
-      printf ("CALL\n");
-      return 2;
-    case OP_RETURN:
-      printf ("RETURN\n");
-      return 1;
-    default:
-      printf ("unknown op %02x", op);
-      return 1;
+    case OBJECT_STRING:
+      break;
+    case OBJECT_FUNCTION:
+      {
+        function_t *function = (function_t *)o;
+        block_free (&function->block);
+        reg_block_free (&function->reg);
+        free (function->captures);
+        break;
+      }
+    case OBJECT_CLOSURE:
+    case OBJECT_ROPE:
+    case OBJECT_UPVALUE:
+      break;
     }
 }
 
 void
-dbg_disassemble_all ()
+gc_free_nursery ()
 {
-  block_t *block = get_block ();
-  for (size_t offset = 0; offset < block->length;)
+  size_t offset = 0;
+  while (offset < vm.nursery_used)
     {
-      printf ("%04zx ", offset);
-      offset += dbg_disassemble_operation (offset);
+      object_t *o = (object_t *)(vm.nursery + offset);
+      offset += gc_align (object_sizeof (o));
+      if (o->next == NULL)
+        gc_release_young (o);
     }
+  vm.nursery_used = 0;
 }
 
-void print_value (value_t v);
-
 void
-dbg_print_stack ()
+gc_free_list (object_t *o)
 {
-  for (value_t *v = vm.stack; v < vm.top; v++)
+  while (o != NULL)
     {
-      printf ("[");
-      print_value (*v);
-      printf ("]");
+      object_t *next = o->next;
+      gc_free_object (o);
+      o = next;
     }
-  printf ("\n");
 }
 
-/* INTERPRET */
-
-value_t
-value_from_number (double n)
+void
+gc_free_all ()
 {
-  value_t v = { TYPE_NUMBER, { .number = n } };
-  return v;
+  gc_free_nursery ();
+  gc_free_list (vm.objects);
+  gc_free_list (vm.sweeping);
+  free (vm.gray.objects);
+  free (vm.promoted.objects);
+  free (vm.remembered.objects);
+  free (vm.nursery);
+  free (vm.young_globals);
 }
 
-bool
-value_to_boolean (value_t v)
+void
+gc_mark_object (object_t *o)
 {
-  switch (v.type)
-    {
-    case TYPE_NIL:
-      return false;
-    case TYPE_BOOL:
-      return v.as.boolean;
-    case TYPE_NUMBER:
-      return v.as.number != 0;
-    case TYPE_OBJECT:
-      return true;
-    }
+  /* young objects are traced by promoting them */
+  if (o == NULL || o->mark == vm.epoch || gc_is_young (o))
+    return;
+
+  o->mark = vm.epoch;
+  object_stack_push (&vm.gray, o);
 }
 
-bool
-check_top_type (value_type_t type)
+void
+gc_mark_value (value_t v)
 {
-  return vm.top[-1].type == type;
+  if (value_is_object (v))
+    gc_mark_object (value_as_object (v));
 }
 
-bool
-check_top_2_type (value_type_t type)
+/* WRITE BARRIERS */
+
+/* called when a reference to v is stored into owner */
+void
+gc_write_barrier (object_t *owner, value_t v)
 {
-  return vm.top[-2].type == type && vm.top[-1].type == type;
+  if (!value_is_object (v))
+    return;
+
+  /* while marking incrementally a black object must not point at a white
+     one, so the stored object is shaded */
+  if (vm.gc_phase == GC_MARK && owner->mark == vm.epoch)
+    gc_mark_value (v);
+
+  /* remember an old object once it may point into the nursery */
+  if (owner->remembered || gc_is_young (owner) || !gc_value_is_young (v))
+    return;
+
+  owner->remembered = true;
+  object_stack_push (&vm.remembered, owner);
 }
 
-bool
-check_top_2_object_type (object_type_t type)
+/* a slot is recorded when it starts holding a young value; if its old value
+   was young too, it was recorded already since the last minor collection.
+   incremental marking scans the slots once, so stores are shaded */
+void
+gc_set_global (int slot, value_t v)
 {
-  return vm.top[-2].as.object->type == type
-         && vm.top[-1].as.object->type == type;
+  if (vm.gc_phase == GC_MARK)
+    gc_mark_value (v);
+
+  value_t *g = &vm.global_values.values[slot];
+  if (gc_value_is_young (v) && !gc_value_is_young (*g))
+    {
+      if (vm.young_global_capacity < vm.young_global_count + 1)
+        {
+          vm.young_global_capacity = vm.young_global_capacity < 8
+                                         ? 8
+                                         : vm.young_global_capacity * 2;
+          vm.young_globals = realloc (
+              vm.young_globals, vm.young_global_capacity * sizeof (int));
+          if (vm.young_globals == NULL)
+            exit (1);
+        }
+      vm.young_globals[vm.young_global_count++] = slot;
+    }
+  *g = v;
 }
 
+/* MINOR COLLECTION */
+
+/* copy a young object into the heap, once, leaving a forwarding pointer */
 void
-print_value (value_t v)
+gc_evacuate (object_t **ref)
 {
-  switch (v.type)
+  object_t *o = *ref;
+  if (o == NULL || !gc_is_young (o))
+    return;
+
+  if (o->next == NULL)
     {
-    case TYPE_NIL:
-      printf ("nil");
-      break;
-    case TYPE_BOOL:
-      printf (v.as.boolean ? "true" : "false");
-      break;
-    case TYPE_NUMBER:
-      printf ("%g", v.as.number);
-      break;
-    case TYPE_OBJECT:
-      switch (v.as.object->type)
+      size_t size = object_sizeof (o);
+      object_t *copy = object_heap_new (o->type, size);
+      object_t *next = copy->next;
+      memcpy (copy, o, size);
+      copy->next = next;
+      o->next = copy;
+      /* a closed upvalue points at its own value */
+      if (o->type == OBJECT_UPVALUE
+          && ((upvalue_t *)o)->location == &((upvalue_t *)o)->closed)
+        ((upvalue_t *)copy)->location = &((upvalue_t *)copy)->closed;
+      object_stack_push (&vm.promoted, copy);
+      copy->mark = vm.epoch;
+      /* promoted in the middle of marking: it's reachable, so gray */
+      if (vm.gc_phase == GC_MARK)
         {
-        case OBJECT_STRING:
-          {
-            string_t *s = (string_t *)v.as.object;
-            printf ("\"%s\"", s->chars);
-            break;
-          }
-        case OBJECT_FUNCTION:
-          {
-            function_t *f = (function_t *)v.as.object;
-            if (f->name == NULL)
-              printf ("<main>");
-            else
-              printf ("<fn %s>", f->name->chars);
-            break;
-          }
-        case OBJECT_CLOSURE:
-          {
-            closure_t *c = (closure_t *)v.as.object;
-            value_t cf = (value_t){ .type = TYPE_OBJECT,
-                                    .as.object = (object_t *)c->function };
-            print_value (cf);
-            break;
-          }
+          copy->mark = !vm.epoch;
+          gc_mark_object (copy);
         }
-      break;
     }
+
+  *ref = o->next;
 }
 
-bool
-call_value (value_t callee, int arg_num)
+void
+gc_evacuate_value (value_t *v)
 {
-  if (callee.type != TYPE_OBJECT || callee.as.object->type != OBJECT_CLOSURE)
-    {
-      printf ("Can't call '");
-      print_value (callee);
-      printf ("' because it's not a function\n");
-      return false;
-    }
+  if (!gc_value_is_young (*v))
+    return;
 
-  call_t *call = &vm.calls[vm.call_count++];
-  closure_t *c = (closure_t *)callee.as.object;
-  int arity = c->function->arity;
-  call->closure = c;
-  call->pc = c->function->block.code;
-  call->slots = vm.top - arg_num - 1;
+  object_t *o = value_as_object (*v);
+  gc_evacuate (&o);
+  *v = value_from_object (o);
+}
 
-  if (arity != arg_num)
+void
+gc_evacuate_fields (object_t *o)
+{
+  switch (o->type)
     {
-      fprintf (stderr, "Expected %d arguments, got %d\n", arity, arg_num);
-      return false;
+    case OBJECT_STRING:
+      break;
+    case OBJECT_FUNCTION:
+      {
+        function_t *f = (function_t *)o;
+        gc_evacuate ((object_t **)&f->name);
+        for (int i = 0; i < f->block.constants.length; i++)
+          gc_evacuate_value (&f->block.constants.values[i]);
+        for (int i = 0; i < f->block.cache_count; i++)
+          gc_evacuate (&f->block.caches[i].callee);
+        break;
+      }
+    case OBJECT_CLOSURE:
+      {
+        closure_t *c = (closure_t *)o;
+        gc_evacuate ((object_t **)&c->function);
+        for (int i = 0; i < c->upvalue_count; i++)
+          gc_evacuate ((object_t **)&c->upvalues[i]);
+        break;
+      }
+    case OBJECT_ROPE:
+      {
+        rope_t *r = (rope_t *)o;
+        gc_evacuate (&r->left);
+        gc_evacuate (&r->right);
+        break;
+      }
+    case OBJECT_UPVALUE:
+      gc_evacuate_value (&((upvalue_t *)o)->closed);
+      break;
     }
+}
 
-  if (vm.call_count == FRAMES_MAX)
+/* young strings that died leave the intern table, survivors are rekeyed to
+   their copies */
+void
+gc_sweep_nursery ()
+{
+  size_t offset = 0;
+  while (offset < vm.nursery_used)
     {
-      fprintf (stderr, "Stack overflow\n");
-      return false;
-    }
+      object_t *o = (object_t *)(vm.nursery + offset);
+      offset += gc_align (object_sizeof (o));
 
-  return true;
+      if (o->type == OBJECT_STRING && ((string_t *)o)->interned)
+        {
+          string_t *s = (string_t *)o;
+          if (o->next != NULL)
+            table_get (&vm.strings, s)->key = (string_t *)o->next;
+          else
+            table_remove (&vm.strings, s);
+        }
+      if (o->next == NULL)
+        gc_release_young (o);
+    }
+  vm.nursery_used = 0;
 }
 
-#define BINARY_OP(o)                                                          \
-  do                                                                          \
-    {                                                                         \
-      if (!check_top_2_type (TYPE_NUMBER))                                    \
-        return RESULT_RUNTIME_ERROR;                                          \
-      double b = vm_pop ().as.number;                                         \
-      double a = vm_pop ().as.number;                                         \
-      vm_push (value_from_number (a o b));                                    \
-    }                                                                         \
-  while (0)
-
-result_t
-run ()
+void
+gc_minor ()
 {
-  call_t *call = &vm.calls[vm.call_count - 1];
-  uint8_t op;
+  size_t before = vm.bytes_allocated;
 
-  while (1)
-    {
-#ifdef DEBUG
-      dbg_print_stack ();
-      dbg_disassemble_operation ((int)(call->pc - get_block ()->code));
-#endif
+  for (value_t *v = vm.stack; v < vm.top; v++)
+    gc_evacuate_value (v);
 
-      switch (op = *call->pc++)
-        {
-        case OP_NIL:
-          vm_push ((value_t){ .type = TYPE_NIL });
-          break;
-        case OP_TRUE:
-          vm_push ((value_t){ .type = TYPE_BOOL, .as = true });
-          break;
-        case OP_FALSE:
-          vm_push ((value_t){ .type = TYPE_BOOL, .as = false });
-          break;
-        case OP_CONSTANT:
-          {
-            value_t v = get_block ()->constants.values[*call->pc++];
-            printf ("%g\n", v.as.number);
-            vm_push (v);
-            break;
-          }
-        case OP_SET_GLOBAL:
-          {
-            value_t v = get_block ()->constants.values[*call->pc++];
-            string_t *k = (string_t *)v.as.object;
-            table_set (&vm.globals, k, vm_pop ());
-            break;
-          }
-        case OP_GET_GLOBAL:
-          {
-            value_t v = get_block ()->constants.values[*call->pc++];
-            string_t *k = (string_t *)v.as.object;
-            vm_push (table_get (&vm.globals, k)->value);
-            break;
-          }
-        case OP_SET_LOCAL:
-          {
-            uint8_t offset = *call->pc++;
-            call->slots[offset] = vm_peek ();
-            break;
-          }
-        case OP_GET_LOCAL:
-          {
-            uint8_t offset = *call->pc++;
-            vm_push (call->slots[offset]);
-            break;
-          }
-        case OP_NEG:
-          {
-            if (!check_top_type (TYPE_NUMBER))
-              return RESULT_RUNTIME_ERROR;
-            vm_push (value_from_number (-vm_pop ().as.number));
-            break;
-          }
-        case OP_ADD:
-          BINARY_OP (+);
-          break;
-        case OP_SUB:
-          BINARY_OP (-);
-          break;
-        case OP_MUL:
-          BINARY_OP (*);
-          break;
-        case OP_DIV:
-          BINARY_OP (/);
-          break;
-        case OP_MOD:
-          {
-            if (!check_top_2_type (TYPE_NUMBER))
-              return RESULT_RUNTIME_ERROR;
-            double b = vm_pop ().as.number;
-            double a = vm_pop ().as.number;
-            vm_push (value_from_number (fmod (a, b)));
-            break;
-          }
-        case OP_NOT:
-          {
-            vm_push ((value_t){ .type = TYPE_BOOL,
-                                .as = !value_to_boolean (vm_pop ()) });
-            break;
-          }
-        case OP_EQ:
-          {
-            value_t b = vm_pop ();
-            value_t a = vm_pop ();
-            bool result = value_are_equal (a, b);
-            vm_push ((value_t){ .type = TYPE_BOOL, .as = result });
-            break;
-          }
-        case OP_CONCAT:
-          {
-            if (!check_top_2_type (TYPE_OBJECT))
-              return RESULT_RUNTIME_ERROR;
-            if (!check_top_2_object_type (OBJECT_STRING))
-              return RESULT_RUNTIME_ERROR;
+  for (int i = 0; i < vm.call_count; i++)
+    gc_evacuate ((object_t **)&vm.calls[i].closure);
 
-            string_t *b = (string_t *)vm_pop ().as.object;
-            string_t *a = (string_t *)vm_pop ().as.object;
+  for (upvalue_t **u = &vm.open_upvalues; *u != NULL; u = &(*u)->next_open)
+    gc_evacuate ((object_t **)u);
 
-            object_t *o = (object_t *)string_concat_and_allocate (
-                a->chars, a->length, b->chars, b->length);
-            vm_push ((value_t){ .type = TYPE_OBJECT, .as.object = o });
-            break;
-          }
-        case OP_PRINT:
-          {
-            print_value (vm_pop ());
-            printf ("\n");
-            break;
-          }
-        case OP_POP:
-          {
-            vm_pop ();
-            break;
-          }
-        case OP_LOOP:
-          {
-            call->pc += 2;
-            uint16_t offset = (call->pc[-2] << 8) | call->pc[-1];
-            call->pc -= offset;
-            break;
-          }
-        case OP_JUMP:
-          {
-            call->pc += 2;
-            uint16_t offset = (call->pc[-2] << 8) | call->pc[-1];
-            call->pc += offset;
-            break;
-          }
-        case OP_JUMP_IF_FALSE:
-          {
-            call->pc += 2;
-            uint16_t offset = (call->pc[-2] << 8) | call->pc[-1];
-            if (!value_to_boolean (vm_peek ()))
-              call->pc += offset;
-            break;
-          }
-        case OP_END_SCOPE:
-          {
-            uint8_t n = *call->pc++;
-            *(vm.top - n - 1) = vm_peek ();
-            vm.top -= n;
-            break;
-          }
-        case OP_CLOSURE:
-          {
-            value_t v = get_block ()->constants.values[*call->pc++];
-            function_t *f = (function_t *)v.as.object;
-            closure_t *c = closure_new (f);
-            object_t *o = (object_t *)c;
-            vm_push ((value_t){ .type = TYPE_OBJECT, .as.object = o });
-            break;
-          }
-        case OP_CALL:
-          {
-            uint8_t arg_num = *call->pc++;
-            if (!call_value (vm_pop (), arg_num))
-              return RESULT_RUNTIME_ERROR;
-            call = &vm.calls[vm.call_count - 1];
-            break;
-          }
-        case OP_RETURN:
-          {
-            value_t v = vm_pop ();
-            vm.call_count--;
-            if (vm.call_count == 0)
-              return RESULT_OK;
+  for (int i = 0; i < vm.young_global_count; i++)
+    gc_evacuate_value (&vm.global_values.values[vm.young_globals[i]]);
+  vm.young_global_count = 0;
 
-            vm.top = call->slots;
-            vm_push (v);
-            call = &vm.calls[vm.call_count - 1];
-            break;
-          }
-        }
+  for (int i = 0; i < vm.remembered.count; i++)
+    {
+      vm.remembered.objects[i]->remembered = false;
+      gc_evacuate_fields (vm.remembered.objects[i]);
     }
+  vm.remembered.count = 0;
+
+  /* promoted objects may point at other young ones */
+  while (vm.promoted.count > 0)
+    gc_evacuate_fields (vm.promoted.objects[--vm.promoted.count]);
+
+  gc_sweep_nursery ();
+
+  if (trace)
+    printf ("gc minor, promoted %zu bytes\n", vm.bytes_allocated - before);
+}
+
+object_t *
+gc_nursery_allocate (size_t size)
+{
+  object_t *o = (object_t *)(vm.nursery + vm.nursery_used);
+  vm.nursery_used += gc_align (size);
+  return o;
 }
 
+/* MAJOR COLLECTION */
+
 void
-scan_new (const char *source)
+gc_mark_array (array_t *array)
 {
-  scan.start = source;
-  scan.current = source;
+  for (int i = 0; i < array->length; i++)
+    gc_mark_value (array->values[i]);
 }
 
-bool
-is_whitespace (char c)
+/* the stack, the frames and open compilers; global slots are marked on
+   their own since there can be many */
+void
+gc_mark_roots ()
 {
-  return c == ' ' || c == '\r' || c == '\n' || c == '\t';
+  for (value_t *v = vm.stack; v < vm.top; v++)
+    gc_mark_value (*v);
+
+  for (int i = 0; i < vm.call_count; i++)
+    gc_mark_object ((object_t *)vm.calls[i].closure);
+
+  for (upvalue_t *u = vm.open_upvalues; u != NULL; u = u->next_open)
+    gc_mark_object ((object_t *)u);
+
+  /* functions still being compiled, with their constant pools */
+  for (compiler_t *c = current; c != NULL; c = c->outer)
+    gc_mark_object ((object_t *)c->function);
 }
 
-bool
-is_word (char c)
+/* vm.globals only maps the names in global_names to slot numbers */
+void
+gc_mark_global (int slot)
 {
-  return c != '(' && c != ')' && !is_whitespace (c);
+  gc_mark_value (vm.global_values.values[slot]);
+  gc_mark_value (vm.global_names.values[slot]);
 }
 
-bool
-is_digit (char c)
+void
+gc_blacken_object (object_t *o)
 {
-  return '0' <= c && c <= '9';
+  switch (o->type)
+    {
+    case OBJECT_STRING:
+      break;
+    case OBJECT_FUNCTION:
+      {
+        function_t *f = (function_t *)o;
+        gc_mark_object ((object_t *)f->name);
+        gc_mark_array (&f->block.constants);
+        /* a cached callee stays alive so the cache can't see its address
+           reused by another closure */
+        for (int i = 0; i < f->block.cache_count; i++)
+          gc_mark_object (f->block.caches[i].callee);
+        break;
+      }
+    case OBJECT_CLOSURE:
+      {
+        closure_t *c = (closure_t *)o;
+        gc_mark_object ((object_t *)c->function);
+        for (int i = 0; i < c->upvalue_count; i++)
+          gc_mark_object ((object_t *)c->upvalues[i]);
+        break;
+      }
+    case OBJECT_ROPE:
+      {
+        rope_t *r = (rope_t *)o;
+        gc_mark_object (r->left);
+        gc_mark_object (r->right);
+        break;
+      }
+    case OBJECT_UPVALUE:
+      gc_mark_value (((upvalue_t *)o)->closed);
+      break;
+    }
 }
 
-bool
-is_number (const char *word_start, const char *word_end)
+void
+gc_trace_references ()
 {
-  const char *c = word_start;
+  while (vm.gray.count > 0)
+    gc_blacken_object (vm.gray.objects[--vm.gray.count]);
+}
 
-  while (is_digit (*c) && c < word_end)
-    c++;
+/* only meaningful while sweeping, for objects in the heap */
+bool
+gc_is_dead (object_t *o)
+{
+  return !gc_is_young (o) && o->mark != vm.epoch;
+}
 
-  return c == word_end;
+/* interned strings don't keep themselves alive, they leave the table when
+   they are freed */
+void
+gc_sweep_object (object_t *o)
+{
+  if (o->type == OBJECT_STRING && ((string_t *)o)->interned)
+    table_remove (&vm.strings, (string_t *)o);
+  gc_free_object (o);
 }
 
 void
-ignore_whitespace ()
+gc_sweep ()
 {
-  while (1)
+  object_t **link = &vm.objects;
+  while (*link != NULL)
     {
-      char c = *scan.current;
-      if (!is_whitespace (c))
-        return;
-      scan.current++;
+      object_t *o = *link;
+      if (!gc_is_dead (o))
+        link = &o->next;
+      else
+        {
+          *link = o->next;
+          gc_sweep_object (o);
+        }
     }
 }
 
-token_t
-token_create (token_type_t type)
+void
+gc_set_next ()
 {
-  token_t token = { .type = type,
-                    .start = scan.start,
-                    .length = scan.current - scan.start };
-  return token;
+  vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW;
+  if (vm.next_gc < GC_HEAP_INITIAL)
+    vm.next_gc = GC_HEAP_INITIAL;
 }
 
-token_t
-token_create_string ()
+void
+gc_collect ()
 {
-  char p = '"';
-  char c;
-  token_t t;
-  while (1)
+  /* empty the nursery first so only the heap has to be traced */
+  gc_minor ();
+
+  size_t before = vm.bytes_allocated;
+
+  vm.epoch = !vm.epoch;
+  gc_mark_roots ();
+  for (int i = 0; i < vm.global_values.length; i++)
+    gc_mark_global (i);
+  gc_trace_references ();
+  gc_sweep ();
+  gc_set_next ();
+
+  if (trace)
+    printf ("gc %zu -> %zu bytes, next at %zu\n", before, vm.bytes_allocated,
+            vm.next_gc);
+}
+
+/* INCREMENTAL COLLECTION */
+
+/* a new cycle flips the epoch, which makes every object white without
+   touching it. objects allocated from then on carry the new epoch: black
+   while marking and left alone by the sweep, which walks the heap as it was
+   when marking ended */
+void
+gc_start_cycle ()
+{
+  gc_minor ();
+  vm.epoch = !vm.epoch;
+  gc_mark_roots ();
+  vm.global_cursor = 0;
+  vm.gc_phase = GC_MARK;
+  vm.gc_cycle_start = vm.bytes_allocated;
+}
+
+/* the stack and frames aren't behind a barrier, so marking ends by
+   rescanning them (after promoting the nursery) and draining what they
+   reach */
+void
+gc_finish_mark ()
+{
+  gc_minor ();
+  gc_mark_roots ();
+  gc_trace_references ();
+
+  vm.sweeping = vm.objects;
+  vm.objects = NULL;
+  vm.gc_phase = GC_SWEEP;
+}
+
+void
+gc_step ()
+{
+  int work = gc_budget;
+
+  if (vm.gc_phase == GC_MARK)
     {
-      if ((c = *scan.current++) == '\0')
+      while (work > 0 && vm.global_cursor < vm.global_values.length)
         {
-          fprintf (stderr, "Missing quote in string");
-          exit (1);
+          gc_mark_global (vm.global_cursor++);
+          work--;
         }
-      if (p != '\\' && c == '"')
-        break;
-      p = c;
+      while (work-- > 0 && vm.gray.count > 0)
+        gc_blacken_object (vm.gray.objects[--vm.gray.count]);
+      if (vm.gray.count == 0 && vm.global_cursor == vm.global_values.length)
+        gc_finish_mark ();
+      return;
     }
-  t = token_create (TOKEN_STRING);
-  t.start += 1;
-  t.length -= 2;
-  return t;
-}
-
-token_t
-scan_token ()
-{
-  ignore_whitespace ();
-  scan.start = scan.current;
 
-  if (*scan.current == '\0')
-    return token_create (TOKEN_END);
+  while (work-- > 0 && vm.sweeping != NULL)
+    {
+      object_t *o = vm.sweeping;
+      vm.sweeping = o->next;
+      if (!gc_is_dead (o))
+        {
+          o->next = vm.objects;
+          vm.objects = o;
+        }
+      else
+        gc_sweep_object (o);
+    }
 
-  char c = *scan.current++;
-  switch (c)
+  if (vm.sweeping == NULL)
     {
-    case '(':
-      return token_create (TOKEN_LPAREN);
-    case ')':
-      return token_create (TOKEN_RPAREN);
-    case '"':
-      return token_create_string ();
+      vm.gc_phase = GC_IDLE;
+      gc_set_next ();
+      if (trace)
+        printf ("gc cycle %zu -> %zu bytes, next at %zu\n",
+                vm.gc_cycle_start, vm.bytes_allocated, vm.next_gc);
     }
+}
 
-  while (is_word (*scan.current))
-    scan.current++;
+/* whatever collection work an allocation has to do first, timed as one
+   pause */
+void
+gc_work (bool young, size_t size)
+{
+  double start = gc_clock ();
+
+#ifdef GC_STRESS
+  if (young)
+    gc_minor ();
+#else
+  if (young && vm.nursery_used + gc_align (size) > GC_NURSERY_SIZE)
+    gc_minor ();
+#endif
 
-  if (is_number (scan.start, scan.current))
-    return token_create (TOKEN_NUMBER);
+  if (vm.gc_phase != GC_IDLE)
+    gc_step ();
+#ifdef GC_STRESS
+  else if (gc_incremental)
+    gc_start_cycle ();
+  else
+    gc_collect ();
+#else
+  else if (vm.bytes_allocated + (young ? 0 : size) > vm.next_gc)
+    {
+      if (gc_incremental)
+        gc_start_cycle ();
+      else
+        gc_collect ();
+    }
+#endif
 
-  return token_create (TOKEN_WORD);
+  double pause = gc_clock () - start;
+  if (pause > vm.gc_max_pause)
+    vm.gc_max_pause = pause;
 }
 
-bool
-is_token_string (token_t token, const char *str)
+/* COMPILER FUNCTIONS */
+
+void
+compiler_new (compiler_t *compiler, function_type_t type)
 {
-  int len = strlen (str);
-  bool same_len = token.length == len;
-  bool same_str = 0 == strncmp (str, token.start, len);
-  return same_str && same_len;
+  compiler->outer = current;
+  compiler->function = function_new ();
+  compiler->type = type;
+  compiler->local_count = 0;
+  compiler->scope_depth = 0;
+  compiler->upvalue_count = 0;
+
+  local_t *local = &compiler->locals[compiler->local_count++];
+  local->depth = 0;
+  local->captured = false;
+  local->name.start = "";
+  local->name.length = 0;
+
+  current = compiler;
 }
 
+/* escape analysis: whether an inner function captured any of the locals
+   from index from up to to */
 bool
-is_token_equal_to (token_t *a, token_t *b)
+compiler_has_captured (int from, int to)
 {
-  if (a->length != b->length)
-    return false;
-  return memcmp (a->start, b->start, a->length) == 0;
+  for (int i = from; i < to; i++)
+    if (current->locals[i].captured)
+      return true;
+  return false;
 }
 
-opcode_t
-is_token_op (token_t token)
+/* only functions with captured locals close them on the way out, the rest
+   return as before */
+function_t *
+compiler_end ()
 {
-  if (token.length == 1)
+  if (compiler_has_captured (0, current->local_count))
     {
-      switch (*token.start)
-        {
-        case '+':
-          return OP_ADD;
-        case '-':
-          return OP_SUB;
-        case '*':
-          return OP_MUL;
-        case '/':
-          return OP_DIV;
-        case '%':
-          return OP_MOD;
-        case '=':
-          return OP_EQ;
-        }
+      block_push (OP_CLOSE);
+      block_push (0);
     }
-  if (is_token_string (token, ".."))
-    return OP_CONCAT;
-  if (is_token_string (token, "print"))
-    return OP_PRINT;
-  if (is_token_string (token, "not"))
-    return OP_NOT;
-  if (is_token_string (token, "nil"))
-    return OP_NIL;
-  if (is_token_string (token, "true"))
-    return OP_TRUE;
-  if (is_token_string (token, "false"))
-    return OP_FALSE;
+  block_push (OP_RETURN);
 
-  return OP_NOT_BUILTIN;
+  function_t *f = current->function;
+  int count = current->upvalue_count;
+  if (count > 0)
+    {
+      f->captures = malloc (count * sizeof (capture_t));
+      if (f->captures == NULL)
+        exit (1);
+      memcpy (f->captures, current->upvalues, count * sizeof (capture_t));
+      f->upvalue_count = count;
+    }
+
+  current = current->outer;
+  return f;
 }
 
 void
-local_set_new (token_t token)
+compiler_scope_create ()
 {
-  local_t *local = &current->locals[current->local_count++];
-  local->name = token;
-  local->depth = current->scope_depth;
+  current->scope_depth++;
 }
 
 void
-emit_set_local (token_t token)
+compiler_scope_delete ()
 {
-  if (current->local_count == UINT8_OVER)
+  current->scope_depth--;
+
+  uint8_t n = current->local_count;
+
+  while (current->local_count > 0
+         && current->locals[current->local_count - 1].depth
+                > current->scope_depth)
+    current->local_count--;
+
+  n -= current->local_count;
+
+  if (compiler_has_captured (current->local_count,
+                             current->local_count + n))
     {
-      fprintf (stderr, "Too many locals\n");
-      return;
+      block_push (OP_CLOSE);
+      block_push (current->local_count);
     }
 
-  for (int i = current->local_count - 1; i >= 0; i--)
+  if (n > 1)
     {
-      local_t *local = &current->locals[i];
-      if (local->depth != -1 && local->depth < current->scope_depth)
-        break;
-
-      if (is_token_equal_to (&token, &local->name))
-        {
-          block_push (OP_SET_LOCAL);
-          block_push (i);
-          block_push (OP_POP);
-          return;
-        }
+      block_push (OP_END_SCOPE);
+      block_push (n);
     }
+}
 
-  local_set_new (token);
-  block_push (OP_SET_LOCAL);
-  block_push (current->local_count - 1);
+/* REGISTER COMPILER */
+
+void
+slot_materialize (translator_t *t, int p)
+{
+  slot_t *slot = &t->slots[p];
+  if (slot->kind == SLOT_REGISTER)
+    return;
+
+  reg_push (t->reg, slot->kind == SLOT_LOCAL ? ROP_MOVE : ROP_LOADK);
+  reg_push (t->reg, p);
+  reg_push (t->reg, slot->index);
+  slot->kind = SLOT_REGISTER;
+  t->last_dst = -1;
+}
+
+bool
+slot_is_aliased (translator_t *t, int r)
+{
+  for (int p = 0; p < t->depth; p++)
+    if (t->slots[p].kind == SLOT_LOCAL && t->slots[p].index == r)
+      return true;
+  return false;
+}
+
+void
+slot_release (translator_t *t, int r)
+{
+  /* values still read from register r get their own copy before r is
+     overwritten */
+  for (int p = 0; p < t->depth; p++)
+    if (t->slots[p].kind == SLOT_LOCAL && t->slots[p].index == r)
+      slot_materialize (t, p);
+}
+
+void
+slot_flush (translator_t *t)
+{
+  for (int p = 0; p < t->depth; p++)
+    slot_materialize (t, p);
 }
 
 int
-find_local (token_t *token)
+slot_operand (translator_t *t, int p)
 {
-  for (int i = current->local_count - 1; i >= 0; i--)
+  slot_t *slot = &t->slots[p];
+  if (slot->kind == SLOT_CONSTANT)
+    slot_materialize (t, p);
+  return slot->kind == SLOT_LOCAL ? slot->index : p;
+}
+
+bool
+slot_push (translator_t *t, slot_kind_t kind, int index)
+{
+  if (t->depth == UINT8_OVER)
     {
-      local_t *local = &current->locals[i];
-      if (is_token_equal_to (token, &local->name))
-        return i;
+      fprintf (stderr, "Too many registers\n");
+      return false;
     }
-  return -1;
+
+  t->slots[t->depth] = (slot_t){ .kind = kind, .index = index };
+  t->depth++;
+  if (t->reg->frame_size < t->depth)
+    t->reg->frame_size = t->depth;
+  return true;
 }
 
 bool
-emit_get_local (token_t token)
+slot_need (translator_t *t, int n)
 {
-  int n = find_local (&token);
-  if (n == -1)
+  if (t->depth < n)
     {
-      fprintf (stderr, "Couldn't find '%.*s'\n", token.length, token.start);
+      fprintf (stderr, "Can't translate an operation with missing operands\n");
       return false;
     }
+  return true;
+}
 
-  block_push (OP_GET_LOCAL);
-  block_push (n);
+bool
+reg_emit_dst (translator_t *t, reg_opcode_t op)
+{
+  int dst = t->depth;
+  if (!slot_push (t, SLOT_REGISTER, dst))
+    return false;
+
+  slot_release (t, dst);
+  reg_push (t->reg, op);
+  t->last_dst = t->reg->length;
+  reg_push (t->reg, dst);
   return true;
 }
 
 void
-emit_set_global (token_t token)
+reg_emit_jump (translator_t *t, int target)
 {
-  string_t *s = string_copy ((char *)token.start, token.length);
-  value_t k = { .type = TYPE_OBJECT, .as.object = (object_t *)s };
-  block_push_constant (k, OP_SET_GLOBAL);
+  if (t->offsets[target] != -1)
+    {
+      int jump = t->reg->length + 2 - t->offsets[target];
+      if (jump > UINT16_MAX)
+        {
+          fprintf (stderr, "'while' jump is too large\n");
+          exit (1);
+        }
+      reg_push (t->reg, (jump >> 8) & 0xff);
+      reg_push (t->reg, jump & 0xff);
+      return;
+    }
+
+  /* forward jumps are patched once every leader has an offset */
+  reg_push (t->reg, 0);
+  reg_push (t->reg, 0);
+  t->jumps[t->jump_count] = t->reg->length - 2;
+  t->targets[t->jump_count] = target;
+  t->jump_count++;
 }
 
+/* a path reaching a join deeper than the shallowest one brings its top value
+   down to the join's depth, the values between are left over by forms like
+   'do' and are dropped. slots must be flushed first */
 bool
-emit_get_global (token_t token)
+reg_join (translator_t *t, int target)
 {
-  string_t *s = string_copy ((char *)token.start, token.length);
-  value_t k = { .type = TYPE_OBJECT, .as.object = (object_t *)s };
+  int depth = t->depths[target];
+  if (depth <= 0 || t->depth <= depth)
+    return false;
+
+  reg_push (t->reg, ROP_MOVE);
+  reg_push (t->reg, depth - 1);
+  reg_push (t->reg, t->depth - 1);
+  return true;
+}
 
-  pair_t *p = table_get (&vm.globals, s);
-  if (p->key == NULL)
+void
+reg_patch_jumps (translator_t *t)
+{
+  uint8_t *code = t->reg->code;
+  for (int i = 0; i < t->jump_count; i++)
     {
-      fprintf (stderr, "Couldn't find '%.*s'\n", token.length, token.start);
-      return false;
+      int at = t->jumps[i];
+      int jump = t->offsets[t->targets[i]] - at - 2;
+      if (jump > UINT16_MAX)
+        {
+          fprintf (stderr, "'if' jump is too large\n");
+          exit (1);
+        }
+      code[at] = (jump >> 8) & 0xff;
+      code[at + 1] = jump & 0xff;
     }
-
-  block_push_constant (k, OP_GET_GLOBAL);
-  return true;
 }
 
 bool
-emit_word (token_t token)
+reg_translate_set_local (translator_t *t, int offset)
 {
-  bool found = (*token.start == '_') ? emit_get_global (token)
-                                     : emit_get_local (token);
+  block_t *block = t->block;
+  int n = block->code[offset + 1];
+  int top = t->depth - 1;
+  int next = offset + 2;
+  bool pop = next < block->length && block->code[next] == OP_POP
+             && t->depths[next] == -1;
+
+  /* a new local takes the value's own slot */
+  if (n == top)
+    {
+      slot_materialize (t, top);
+      return false;
+    }
 
-#ifdef DEBUG
-  printf ("emit word '%.*s'\n", token.length, token.start);
-#endif
-  return found;
-}
+  slot_t value = t->slots[top];
+  if (value.kind == SLOT_LOCAL && value.index == n)
+    ;
+  else if (pop && value.kind == SLOT_REGISTER && t->last_dst != -1
+           && t->reg->code[t->last_dst] == top && !slot_is_aliased (t, n))
+    {
+      /* retarget the instruction that computed the value */
+      t->reg->code[t->last_dst] = n;
+    }
+  else
+    {
+      slot_release (t, n);
+      value = t->slots[top];
+      reg_push (t->reg, value.kind == SLOT_CONSTANT ? ROP_LOADK : ROP_MOVE);
+      reg_push (t->reg, n);
+      reg_push (t->reg, value.kind == SLOT_REGISTER ? top : value.index);
+    }
+
+  t->last_dst = -1;
+  if (n < t->depth)
+    t->slots[n] = (slot_t){ .kind = SLOT_REGISTER, .index = n };
+  if (t->reg->frame_size <= n)
+    t->reg->frame_size = n + 1;
+
+  if (pop)
+    t->depth--;
+  return pop;
+}
+
+bool
+reg_translate_binary (translator_t *t, reg_opcode_t op, reg_opcode_t op_k)
+{
+  if (!slot_need (t, 2))
+    return false;
+
+  int b = slot_operand (t, t->depth - 2);
+  slot_t c = t->slots[t->depth - 1];
+  if (c.kind == SLOT_CONSTANT && op_k != op)
+    op = op_k;
+  else
+    c.index = slot_operand (t, t->depth - 1);
+
+  t->depth -= 2;
+  if (!reg_emit_dst (t, op))
+    return false;
+  reg_push (t->reg, b);
+  reg_push (t->reg, c.index);
+  return true;
+}
+
+bool
+reg_translate_unary (translator_t *t, reg_opcode_t op)
+{
+  if (!slot_need (t, 1))
+    return false;
+
+  int b = slot_operand (t, t->depth - 1);
+  t->depth--;
+  if (!reg_emit_dst (t, op))
+    return false;
+  reg_push (t->reg, b);
+  return true;
+}
+
+bool
+reg_translate_op (translator_t *t, int offset)
+{
+  uint8_t *code = t->block->code;
+
+  switch (code[offset])
+    {
+    case OP_NIL:
+      return reg_emit_dst (t, ROP_NIL);
+    case OP_TRUE:
+      return reg_emit_dst (t, ROP_TRUE);
+    case OP_FALSE:
+      return reg_emit_dst (t, ROP_FALSE);
+    case OP_CONSTANT:
+      return slot_push (t, SLOT_CONSTANT, code[offset + 1]);
+    case OP_SET_GLOBAL:
+      {
+        if (!slot_need (t, 1))
+          return false;
+        int a = slot_operand (t, t->depth - 1);
+        t->depth--;
+        reg_push (t->reg, ROP_SET_GLOBAL);
+        reg_push (t->reg, code[offset + 1]);
+        reg_push (t->reg, code[offset + 2]);
+        reg_push (t->reg, a);
+        t->last_dst = -1;
+        return true;
+      }
+    case OP_GET_GLOBAL:
+      if (!reg_emit_dst (t, ROP_GET_GLOBAL))
+        return false;
+      reg_push (t->reg, code[offset + 1]);
+      reg_push (t->reg, code[offset + 2]);
+      return true;
+    case OP_GET_LOCAL:
+      {
+        int n = code[offset + 1];
+        if (n < t->depth)
+          slot_materialize (t, n);
+        if (t->reg->frame_size <= n)
+          t->reg->frame_size = n + 1;
+        return slot_push (t, SLOT_LOCAL, n);
+      }
+    case OP_NEG:
+      return reg_translate_unary (t, ROP_NEG);
+    case OP_NOT:
+      return reg_translate_unary (t, ROP_NOT);
+    case OP_ADD:
+      return reg_translate_binary (t, ROP_ADD, ROP_ADDK);
+    case OP_SUB:
+      return reg_translate_binary (t, ROP_SUB, ROP_SUBK);
+    case OP_MUL:
+      return reg_translate_binary (t, ROP_MUL, ROP_MULK);
+    case OP_DIV:
+      return reg_translate_binary (t, ROP_DIV, ROP_DIVK);
+    case OP_MOD:
+      return reg_translate_binary (t, ROP_MOD, ROP_MODK);
+    case OP_EQ:
+      return reg_translate_binary (t, ROP_EQ, ROP_EQK);
+    case OP_CONCAT:
+      return reg_translate_binary (t, ROP_CONCAT, ROP_CONCAT);
+    case OP_PRINT:
+      {
+        if (!slot_need (t, 1))
+          return false;
+        int a = slot_operand (t, t->depth - 1);
+        t->depth--;
+        reg_push (t->reg, ROP_PRINT);
+        reg_push (t->reg, a);
+        t->last_dst = -1;
+        return true;
+      }
+    case OP_POP:
+      if (!slot_need (t, 1))
+        return false;
+      t->depth--;
+      return true;
+    case OP_END_SCOPE:
+      {
+        int n = code[offset + 1];
+        if (!slot_need (t, n + 1))
+          return false;
+        int src = t->depth - 1;
+        slot_t top = t->slots[src];
+        t->depth -= n + 1;
+        if (top.kind != SLOT_REGISTER)
+          return slot_push (t, top.kind, top.index);
+        if (!reg_emit_dst (t, ROP_MOVE))
+          return false;
+        reg_push (t->reg, src);
+        return true;
+      }
+    case OP_CLOSURE:
+      if (!reg_emit_dst (t, ROP_CLOSURE))
+        return false;
+      reg_push (t->reg, code[offset + 1]);
+      return true;
+    case OP_GET_UPVALUE:
+      if (!reg_emit_dst (t, ROP_GET_UPVALUE))
+        return false;
+      reg_push (t->reg, code[offset + 1]);
+      return true;
+    case OP_CLOSE:
+      /* locals always live in their own registers, so those are what the
+         upvalues point at */
+      reg_push (t->reg, ROP_CLOSE);
+      reg_push (t->reg, code[offset + 1]);
+      t->last_dst = -1;
+      return true;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      {
+        int arg_num = code[offset + 1];
+        if (!slot_need (t, arg_num + 1))
+          return false;
+        slot_flush (t);
+        t->depth -= arg_num + 1;
+        reg_push (t->reg, code[offset] == OP_CALL ? ROP_CALL : ROP_TAIL_CALL);
+        reg_push (t->reg, t->depth);
+        reg_push (t->reg, arg_num);
+        reg_push (t->reg, code[offset + 2]);
+        reg_push (t->reg, code[offset + 3]);
+        t->last_dst = -1;
+        return slot_push (t, SLOT_REGISTER, t->depth);
+      }
+    case OP_RETURN:
+      {
+        if (!slot_need (t, 1))
+          return false;
+        int a = slot_operand (t, t->depth - 1);
+        reg_push (t->reg, ROP_RETURN);
+        reg_push (t->reg, a);
+        return true;
+      }
+    case OP_LOOP:
+      /* the loop head keeps the depth the loop was entered at, and what a
+         turn leaves above it is dropped */
+      slot_flush (t);
+      reg_push (t->reg, ROP_LOOP);
+      reg_emit_jump (t, op_jump_target (t->block, offset));
+      t->last_dst = -1;
+      return true;
+    case OP_JUMP:
+      {
+        int target = op_jump_target (t->block, offset);
+        slot_flush (t);
+        reg_join (t, target);
+        reg_push (t->reg, ROP_JUMP);
+        reg_emit_jump (t, target);
+        t->last_dst = -1;
+        return true;
+      }
+    case OP_JUMP_IF_FALSE:
+      {
+        if (!slot_need (t, 1))
+          return false;
+        int target = op_jump_target (t->block, offset);
+        slot_flush (t);
+        reg_push (t->reg, ROP_JUMP_IF_FALSE);
+        reg_push (t->reg, t->depth - 1);
+        if (t->depths[target] > 0 && t->depth > t->depths[target])
+          {
+            /* only the taken path moves its top down, so it goes through
+               a move and a jump that the other path skips */
+            reg_push (t->reg, 0);
+            reg_push (t->reg, 3);
+            reg_push (t->reg, ROP_JUMP);
+            reg_push (t->reg, 0);
+            reg_push (t->reg, 6);
+            reg_join (t, target);
+            reg_push (t->reg, ROP_JUMP);
+          }
+        reg_emit_jump (t, target);
+        t->last_dst = -1;
+        return true;
+      }
+    }
+
+  fprintf (stderr, "Can't translate op %02x\n", code[offset]);
+  return false;
+}
+
+/* translate a function's stack code to register code, tracking statically
+   which register holds each stack slot */
+bool
+reg_compile (function_t *f)
+{
+  block_t *block = &f->block;
+  translator_t t = { .block = block, .reg = &f->reg, .last_dst = -1 };
+  int length = block->length;
+  bool reachable = true;
+  bool ok = true;
+
+  t.depths = arena_alloc (&scratch, (length + 1) * sizeof (int));
+  t.offsets = arena_alloc (&scratch, (length + 1) * sizeof (int));
+  t.jumps = arena_alloc (&scratch, (length + 1) * sizeof (int));
+  t.targets = arena_alloc (&scratch, (length + 1) * sizeof (int));
+  t.jump_count = 0;
+  for (int i = 0; i <= length; i++)
+    {
+      t.depths[i] = -1;
+      t.offsets[i] = -1;
+    }
+
+  /* find jump targets first, they start a new basic block */
+  bool *leaders = arena_calloc (&scratch, (length + 1) * sizeof (bool));
+  for (int offset = 0; offset < length; offset += op_length (block->code[offset]))
+    {
+      if (op_is_jump (block->code[offset]))
+        leaders[op_jump_target (block, offset)] = true;
+    }
+
+  /* every join takes the smallest depth any forward path brings to it,
+     worked out up front so the deeper paths know where to move their top
+     value before they get there */
+  int depth = f->arity + 1;
+  for (int offset = 0; offset < length;)
+    {
+      uint8_t *code = &block->code[offset];
+      if (leaders[offset])
+        {
+          if (reachable && (t.depths[offset] == -1 || depth < t.depths[offset]))
+            t.depths[offset] = depth;
+          reachable = t.depths[offset] != -1;
+          depth = t.depths[offset];
+        }
+      offset += op_length (code[0]);
+      if (!reachable)
+        continue;
+
+      depth += op_stack_effect (code);
+      if (op_is_jump (code[0]) && code[0] != OP_LOOP)
+        {
+          int target = op_jump_target (block, code - block->code);
+          if (t.depths[target] == -1 || depth < t.depths[target])
+            t.depths[target] = depth;
+        }
+      reachable = code[0] != OP_JUMP && code[0] != OP_LOOP
+                  && code[0] != OP_RETURN;
+    }
+  reachable = true;
+
+  f->reg.length = 0;
+  f->reg.frame_size = f->arity + 1;
+  for (int i = 0; i <= f->arity; i++)
+    slot_push (&t, SLOT_REGISTER, i);
+
+  for (int offset = 0; ok && offset < length;)
+    {
+      uint8_t op = block->code[offset];
+
+      if (leaders[offset])
+        {
+          /* all paths into a basic block agree on plain registers, and on
+             the smallest stack depth if they disagree */
+          if (reachable)
+            {
+              slot_flush (&t);
+              reg_join (&t, offset);
+            }
+          reachable = t.depths[offset] != -1;
+          t.depth = reachable ? t.depths[offset] : 0;
+          for (int p = 0; p < t.depth; p++)
+            t.slots[p] = (slot_t){ .kind = SLOT_REGISTER, .index = p };
+          t.offsets[offset] = f->reg.length;
+          t.last_dst = -1;
+        }
+
+      if (!reachable)
+        {
+          offset += op_length (op);
+          continue;
+        }
+
+      if (op == OP_SET_LOCAL)
+        {
+          if (reg_translate_set_local (&t, offset))
+            offset += op_length (OP_POP);
+        }
+      else
+        ok = reg_translate_op (&t, offset);
+
+      if (op == OP_JUMP || op == OP_LOOP || op == OP_RETURN)
+        reachable = false;
+      offset += op_length (op);
+    }
+
+  t.offsets[length] = f->reg.length;
+  if (ok)
+    reg_patch_jumps (&t);
+
+  return ok;
+}
+
+/* TAIL CALLS */
+
+/* a call is in tail position when its result goes straight to the return,
+   which is the case for the last expression of an 'on' body or of a branch
+   of an 'if' there. jumps and scope ends only lead there */
+bool
+tail_position (block_t *block, int offset)
+{
+  while (offset < block->length)
+    switch (block->code[offset])
+      {
+      case OP_RETURN:
+        return true;
+      case OP_JUMP:
+        offset = op_jump_target (block, offset);
+        break;
+      case OP_END_SCOPE:
+      case OP_CLOSE:
+        offset += 2;
+        break;
+      default:
+        return false;
+      }
+  return false;
+}
+
+void
+tail_call_mark (block_t *block)
+{
+  for (int i = 0; i < block->length; i += op_length (block->code[i]))
+    if (block->code[i] == OP_CALL && tail_position (block, i + 4))
+      block->code[i] = OP_TAIL_CALL;
+}
+
+/* PEEPHOLE */
+
+bool
+peephole_jump_pops (block_t *block, bool *leaders, int offset)
+{
+  /* both paths of a conditional jump pop the condition right away */
+  int next = offset + 3;
+  return next < block->length && block->code[next] == OP_POP && !leaders[next]
+         && block->code[op_jump_target (block, offset)] == OP_POP;
+}
+
+/* fuse common instruction sequences into superinstructions, then fix up
+   the jumps to the shorter code */
+void
+peephole_optimize (block_t *block)
+{
+  uint8_t *code = block->code;
+  int length = block->length;
+  uint8_t *out = arena_alloc (&scratch, length);
+  int *map = arena_alloc (&scratch, (length + 1) * sizeof (int));
+  int *jumps = arena_alloc (&scratch, length * sizeof (int));
+  int *targets = arena_alloc (&scratch, length * sizeof (int));
+  bool *leaders = arena_calloc (&scratch, (length + 1) * sizeof (bool));
+  int jump_count = 0;
+  int o = 0;
+
+  /* sequences must not swallow a jump target, including the instruction
+     after a target's POP, where fused conditional jumps land */
+  for (int i = 0; i < length; i += op_length (code[i]))
+    if (op_is_jump (code[i]))
+      {
+        int target = op_jump_target (block, i);
+        leaders[target] = true;
+        if (code[target] == OP_POP)
+          leaders[target + 1] = true;
+      }
+
+  for (int i = 0; i < length;)
+    {
+      uint8_t op = code[i];
+      int next = i + op_length (op);
+      bool fusable = next < length && !leaders[next];
+      map[i] = o;
+
+      if (op == OP_SET_LOCAL && fusable && code[next] == OP_POP)
+        {
+          out[o++] = OP_SET_LOCAL_POP;
+          out[o++] = code[i + 1];
+          i = next + 1;
+          continue;
+        }
+
+      if (op == OP_GET_LOCAL && fusable && next + 2 < length
+          && !leaders[next + 2] && code[next + 2] == OP_ADD
+          && (code[next] == OP_GET_LOCAL || code[next] == OP_CONSTANT))
+        {
+          out[o++] = code[next] == OP_GET_LOCAL ? OP_ADD_LOCALS
+                                                : OP_ADD_LOCAL_CONSTANT;
+          out[o++] = code[i + 1];
+          out[o++] = code[next + 1];
+          i = next + 3;
+          continue;
+        }
+
+      if (op == OP_NOT && fusable && code[next] == OP_JUMP_IF_FALSE
+          && peephole_jump_pops (block, leaders, next))
+        {
+          jumps[jump_count] = o;
+          targets[jump_count++] = op_jump_target (block, next) + 1;
+          out[o++] = OP_JUMP_IF_TRUE_POP;
+          o += 2;
+          i = next + 4;
+          continue;
+        }
+
+      if (op == OP_JUMP_IF_FALSE && peephole_jump_pops (block, leaders, i))
+        {
+          jumps[jump_count] = o;
+          targets[jump_count++] = op_jump_target (block, i) + 1;
+          out[o++] = OP_JUMP_IF_FALSE_POP;
+          o += 2;
+          i = next + 1;
+          continue;
+        }
+
+      if (op_is_jump (op))
+        {
+          jumps[jump_count] = o;
+          targets[jump_count++] = op_jump_target (block, i);
+        }
+
+      memcpy (out + o, code + i, next - i);
+      o += next - i;
+      i = next;
+    }
+  map[length] = o;
+
+  for (int j = 0; j < jump_count; j++)
+    {
+      int at = jumps[j];
+      int target = map[targets[j]];
+      int jump = out[at] == OP_LOOP ? at + 3 - target : target - at - 3;
+      out[at + 1] = (jump >> 8) & 0xff;
+      out[at + 2] = jump & 0xff;
+    }
+
+  memcpy (code, out, o);
+  block->length = o;
+}
+
+/* STACK SIZE */
+
+/* the deepest the stack gets above a frame's slots, following the code in
+   order and taking the deeper of the depths where paths meet. a loop body
+   that leaves values behind is caught by the check at OP_LOOP */
+int
+stack_size (block_t *block, int base)
+{
+  int length = block->length;
+  int *depths = arena_alloc (&scratch, (length + 1) * sizeof (int));
+  for (int i = 0; i <= length; i++)
+    depths[i] = -1;
+
+  int depth = base;
+  int max = base;
+  bool reachable = true;
+  for (int offset = 0; offset < length;)
+    {
+      uint8_t *code = &block->code[offset];
+      if (depths[offset] != -1 && (!reachable || depths[offset] > depth))
+        {
+          depth = depths[offset];
+          reachable = true;
+        }
+      offset += op_length (code[0]);
+      if (!reachable)
+        continue;
+
+      depth += op_stack_effect (code);
+      if (depth > max)
+        max = depth;
+
+      if (op_is_jump (code[0]) && code[0] != OP_LOOP)
+        {
+          int target = op_jump_target (block, code - block->code);
+          if (depths[target] < depth)
+            depths[target] = depth;
+        }
+      reachable = code[0] != OP_JUMP && code[0] != OP_LOOP
+                  && code[0] != OP_RETURN;
+    }
+  return max;
+}
+
+/* the register VM translates the plain stack code, so it runs first */
+bool
+function_finish (function_t *f)
+{
+  tail_call_mark (&f->block);
+  bool ok = !use_registers || reg_compile (f);
+  if (ok)
+    {
+      peephole_optimize (&f->block);
+      f->stack_size = stack_size (&f->block, f->arity + 1);
+      if (f->stack_size < f->reg.frame_size)
+        f->stack_size = f->reg.frame_size;
+    }
+
+  arena_reset (&scratch);
+  return ok;
+}
+
+/* VM FUNCTIONS */
+
+void
+vm_new ()
+{
+  vm.calls = malloc (frames_initial * sizeof (call_t));
+  vm.call_capacity = frames_initial;
+  /* the compiler roots values on the stack before any frame reserves it */
+  int size = stack_initial < STACK_HEADROOM ? STACK_HEADROOM : stack_initial;
+  vm.stack = malloc (size * sizeof (value_t));
+  vm.stack_end = vm.stack + size;
+  if (vm.calls == NULL || vm.stack == NULL)
+    exit (1);
+  vm.top = vm.stack;
+  vm.open_upvalues = NULL;
+  vm.objects = NULL;
+  vm.call_count = 0;
+  vm.bytes_allocated = 0;
+  vm.next_gc = GC_HEAP_INITIAL;
+  vm.gray = (object_stack_t){ NULL, 0, 0 };
+  vm.epoch = 0;
+  vm.gc_phase = GC_IDLE;
+  vm.sweeping = NULL;
+  vm.gc_max_pause = 0;
+  vm.nursery = malloc (GC_NURSERY_SIZE);
+  vm.nursery_used = 0;
+  vm.promoted = (object_stack_t){ NULL, 0, 0 };
+  vm.remembered = (object_stack_t){ NULL, 0, 0 };
+  for (int i = 0; i < SLAB_CLASSES; i++)
+    vm.slabs[i] = NULL;
+  vm.slab_arena.chunks = NULL;
+  vm.young_globals = NULL;
+  vm.young_global_count = 0;
+  vm.young_global_capacity = 0;
+  table_new (&vm.strings);
+  table_new (&vm.globals);
+  array_new (&vm.global_values);
+  array_new (&vm.global_names);
+  vm.image = NULL;
+  vm.image_size = 0;
+}
+
+void
+vm_free ()
+{
+  table_free (&vm.strings);
+  table_free (&vm.globals);
+  array_free (&vm.global_values);
+  array_free (&vm.global_names);
+  gc_free_all ();
+  arena_free (&vm.slab_arena);
+  arena_free (&scratch);
+  free (vm.calls);
+  free (vm.stack);
+  if (vm.image != NULL)
+    munmap (vm.image, vm.image_size);
+}
+
+void
+vm_reset ()
+{
+  current->function->block.length = 0;
+  current->function->block.cache_count = 0;
+  vm.call_count = 0;
+  vm.top = vm.stack;
+}
+
+void
+vm_push (value_t value)
+{
+  *vm.top = value;
+  vm.top++;
+}
+
+/* move the value stack to a bigger buffer, taking along every pointer
+   into it: the top, the frames' slots and the open upvalues */
+bool
+vm_stack_grow (size_t needed)
+{
+  size_t capacity = vm.stack_end - vm.stack;
+  while (capacity < needed)
+    capacity *= 2;
+  if (capacity > STACK_MAX)
+    {
+      if (needed > STACK_MAX)
+        return false;
+      capacity = STACK_MAX;
+    }
+
+  value_t *stack = malloc (capacity * sizeof (value_t));
+  if (stack == NULL)
+    exit (1);
+  /* in register mode live registers can sit above the top while a call is
+     being set up, so the whole buffer goes along */
+  memcpy (stack, vm.stack, (vm.stack_end - vm.stack) * sizeof (value_t));
+
+  for (int i = 0; i < vm.call_count; i++)
+    vm.calls[i].slots = stack + (vm.calls[i].slots - vm.stack);
+  for (upvalue_t *u = vm.open_upvalues; u != NULL; u = u->next_open)
+    u->location = stack + (u->location - vm.stack);
+  vm.top = stack + (vm.top - vm.stack);
+
+  free (vm.stack);
+  vm.stack = stack;
+  vm.stack_end = stack + capacity;
+  return true;
+}
+
+/* make sure a call to f with its slots at slots has a frame and room for
+   its values. this is the only overflow check, pushes don't make one.
+   returns where the slots are now, or NULL on overflow */
+value_t *
+vm_reserve_call (function_t *f, value_t *slots)
+{
+  if (vm.call_count == vm.call_capacity)
+    {
+      if (vm.call_capacity == FRAMES_MAX)
+        {
+          fprintf (stderr, "Stack overflow\n");
+          return NULL;
+        }
+      vm.call_capacity *= 2;
+      if (vm.call_capacity > FRAMES_MAX)
+        vm.call_capacity = FRAMES_MAX;
+      vm.calls = realloc (vm.calls, vm.call_capacity * sizeof (call_t));
+      if (vm.calls == NULL)
+        exit (1);
+    }
+
+  size_t base = slots - vm.stack;
+  size_t needed = base + f->stack_size + STACK_HEADROOM;
+  if (vm.stack + needed > vm.stack_end && !vm_stack_grow (needed))
+    {
+      fprintf (stderr, "Stack overflow\n");
+      return NULL;
+    }
+  return vm.stack + base;
+}
+
+value_t
+vm_pop ()
+{
+  vm.top--;
+  return *vm.top;
+}
+
+value_t
+vm_peek ()
+{
+  return *(vm.top - 1);
+}
+
+/* GLOBAL FUNCTIONS */
+
+int
+global_find (string_t *name)
+{
+  if (vm.globals.count == 0)
+    return -1;
+
+  pair_t *p = table_get (&vm.globals, name);
+  if (p == NULL)
+    return -1;
+  return (int)value_as_number (p->value);
+}
+
+int
+global_declare (string_t *name)
+{
+  int slot = global_find (name);
+  if (slot != -1)
+    return slot;
+
+  slot = vm.global_values.length;
+  if (slot > UINT16_MAX)
+    {
+      fprintf (stderr, "Too many globals.\n");
+      exit (1);
+    }
+
+  array_push (&vm.global_values, value_nil ());
+  array_push (&vm.global_names, value_from_object ((object_t *)name));
+  table_set (&vm.globals, name, value_from_number (slot));
+  return slot;
+}
+
+string_t *
+global_name (int slot)
+{
+  return (string_t *)value_as_object (vm.global_names.values[slot]);
+}
+
+/* DEBUG */
+
+void print_value (value_t v);
+
+int
+dbg_disassemble_operation (block_t *block, size_t offset)
+{
+  uint8_t constant;
+  value_t value;
+
+  opcode_t op = block->code[offset];
+
+  switch (op)
+    {
+    case OP_NIL:
+      printf ("NIL\n");
+      return 1;
+    case OP_TRUE:
+      printf ("TRUE\n");
+      return 1;
+    case OP_FALSE:
+      printf ("FALSE\n");
+      return 1;
+    case OP_CONSTANT:
+      constant = block->code[offset + 1];
+      value = block->constants.values[constant];
+      printf ("CONSTANT %02x ", constant);
+      print_value (value);
+      printf ("\n");
+      return 2;
+    case OP_SET_GLOBAL:
+    case OP_GET_GLOBAL:
+      {
+        int slot = (block->code[offset + 1] << 8) | block->code[offset + 2];
+        string_t *name = global_name (slot);
+        printf ("%s GLOBAL %d '%.*s'\n", op == OP_SET_GLOBAL ? "SET" : "GET",
+                slot, name->length, name->chars);
+        return 3;
+      }
+    case OP_SET_LOCAL:
+      printf ("SET LOCAL %d\n", block->code[offset + 1]);
+      return 2;
+    case OP_GET_LOCAL:
+      printf ("GET LOCAL %d\n", block->code[offset + 1]);
+      return 2;
+    case OP_NEG:
+      printf ("NEG\n");
+      return 1;
+    case OP_ADD:
+      printf ("ADD\n");
+      return 1;
+    case OP_SUB:
+      printf ("SUB\n");
+      return 1;
+    case OP_MUL:
+      printf ("MUL\n");
+      return 1;
+    case OP_DIV:
+      printf ("DIV\n");
+      return 1;
+    case OP_MOD:
+      printf ("MOD\n");
+      return 1;
+    case OP_NOT:
+      printf ("NOT\n");
+      return 1;
+    case OP_EQ:
+      printf ("EQ\n");
+      return 1;
+    case OP_CONCAT:
+      printf ("CONCAT\n");
+      return 1;
+    case OP_PRINT:
+      printf ("PRINT\n");
+      return 1;
+    case OP_POP:
+      printf ("POP\n");
+      return 1;
+    case OP_LOOP:
+      printf ("LOOP\n");
+      return 3;
+    case OP_JUMP:
+      printf ("JUMP\n");
+      return 3;
+    case OP_JUMP_IF_FALSE:
+      printf ("JUMP IF FALSE\n");
+      return 3;
+    case OP_END_SCOPE:
+      printf ("END SCOPE %d\n", block->code[offset + 1]);
+      return 2;
+    case OP_CLOSURE:
+      printf ("CLOSURE %d\n", block->code[offset + 1]);
+      return 2;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      printf ("%s %d c%d\n", op == OP_CALL ? "CALL" : "TAIL CALL",
+              block->code[offset + 1],
+              (block->code[offset + 2] << 8) | block->code[offset + 3]);
+      return 4;
+    case OP_RETURN:
+      printf ("RETURN\n");
+      return 1;
+    case OP_SET_LOCAL_POP:
+      printf ("SET LOCAL POP %d\n", block->code[offset + 1]);
+      return 2;
+    case OP_ADD_LOCALS:
+      printf ("ADD LOCALS %d %d\n", block->code[offset + 1],
+              block->code[offset + 2]);
+      return 3;
+    case OP_ADD_LOCAL_CONSTANT:
+      constant = block->code[offset + 2];
+      printf ("ADD LOCAL CONSTANT %d %02x ", block->code[offset + 1], constant);
+      print_value (block->constants.values[constant]);
+      printf ("\n");
+      return 3;
+    case OP_JUMP_IF_FALSE_POP:
+      printf ("JUMP IF FALSE POP\n");
+      return 3;
+    case OP_JUMP_IF_TRUE_POP:
+      printf ("JUMP IF TRUE POP\n");
+      return 3;
+    case OP_GET_UPVALUE:
+      printf ("GET UPVALUE %d\n", block->code[offset + 1]);
+      return 2;
+    case OP_CLOSE:
+      printf ("CLOSE %d\n", block->code[offset + 1]);
+      return 2;
+    default:
+      printf ("unknown op %02x", op);
+      return 1;
+    }
+}
+
+void
+dbg_disassemble_all (block_t *block)
+{
+  for (size_t offset = 0; offset < block->length;)
+    {
+      printf ("%04zx ", offset);
+      offset += dbg_disassemble_operation (block, offset);
+    }
+}
+
+int
+dbg_disassemble_register (reg_block_t *reg, int offset)
+{
+  uint8_t *code = reg->code + offset;
+
+  switch (code[0])
+    {
+    case ROP_MOVE:
+      printf ("MOVE r%d r%d\n", code[1], code[2]);
+      return 3;
+    case ROP_LOADK:
+      printf ("LOADK r%d k%d\n", code[1], code[2]);
+      return 3;
+    case ROP_NIL:
+      printf ("NIL r%d\n", code[1]);
+      return 2;
+    case ROP_TRUE:
+      printf ("TRUE r%d\n", code[1]);
+      return 2;
+    case ROP_FALSE:
+      printf ("FALSE r%d\n", code[1]);
+      return 2;
+    case ROP_SET_GLOBAL:
+      printf ("SET GLOBAL g%d r%d\n", (code[1] << 8) | code[2], code[3]);
+      return 4;
+    case ROP_GET_GLOBAL:
+      printf ("GET GLOBAL r%d g%d\n", code[1], (code[2] << 8) | code[3]);
+      return 4;
+    case ROP_NEG:
+      printf ("NEG r%d r%d\n", code[1], code[2]);
+      return 3;
+    case ROP_NOT:
+      printf ("NOT r%d r%d\n", code[1], code[2]);
+      return 3;
+    case ROP_ADD:
+      printf ("ADD r%d r%d r%d\n", code[1], code[2], code[3]);
+      return 4;
+    case ROP_SUB:
+      printf ("SUB r%d r%d r%d\n", code[1], code[2], code[3]);
+      return 4;
+    case ROP_MUL:
+      printf ("MUL r%d r%d r%d\n", code[1], code[2], code[3]);
+      return 4;
+    case ROP_DIV:
+      printf ("DIV r%d r%d r%d\n", code[1], code[2], code[3]);
+      return 4;
+    case ROP_MOD:
+      printf ("MOD r%d r%d r%d\n", code[1], code[2], code[3]);
+      return 4;
+    case ROP_EQ:
+      printf ("EQ r%d r%d r%d\n", code[1], code[2], code[3]);
+      return 4;
+    case ROP_CONCAT:
+      printf ("CONCAT r%d r%d r%d\n", code[1], code[2], code[3]);
+      return 4;
+    case ROP_ADDK:
+      printf ("ADDK r%d r%d k%d\n", code[1], code[2], code[3]);
+      return 4;
+    case ROP_SUBK:
+      printf ("SUBK r%d r%d k%d\n", code[1], code[2], code[3]);
+      return 4;
+    case ROP_MULK:
+      printf ("MULK r%d r%d k%d\n", code[1], code[2], code[3]);
+      return 4;
+    case ROP_DIVK:
+      printf ("DIVK r%d r%d k%d\n", code[1], code[2], code[3]);
+      return 4;
+    case ROP_MODK:
+      printf ("MODK r%d r%d k%d\n", code[1], code[2], code[3]);
+      return 4;
+    case ROP_EQK:
+      printf ("EQK r%d r%d k%d\n", code[1], code[2], code[3]);
+      return 4;
+    case ROP_PRINT:
+      printf ("PRINT r%d\n", code[1]);
+      return 2;
+    case ROP_LOOP:
+      printf ("LOOP %d\n", (code[1] << 8) | code[2]);
+      return 3;
+    case ROP_JUMP:
+      printf ("JUMP %d\n", (code[1] << 8) | code[2]);
+      return 3;
+    case ROP_JUMP_IF_FALSE:
+      printf ("JUMP IF FALSE r%d %d\n", code[1], (code[2] << 8) | code[3]);
+      return 4;
+    case ROP_GET_UPVALUE:
+      printf ("GET UPVALUE r%d u%d\n", code[1], code[2]);
+      return 3;
+    case ROP_CLOSE:
+      printf ("CLOSE r%d\n", code[1]);
+      return 2;
+    case ROP_CLOSURE:
+      printf ("CLOSURE r%d k%d\n", code[1], code[2]);
+      return 3;
+    case ROP_CALL:
+    case ROP_TAIL_CALL:
+      printf ("%s r%d %d c%d\n", code[0] == ROP_CALL ? "CALL" : "TAIL CALL",
+              code[1], code[2], (code[3] << 8) | code[4]);
+      return 5;
+    case ROP_RETURN:
+      printf ("RETURN r%d\n", code[1]);
+      return 2;
+    default:
+      printf ("unknown op %02x", code[0]);
+      return 1;
+    }
+}
+
+void
+dbg_disassemble_all_registers (reg_block_t *reg)
+{
+  for (int offset = 0; offset < reg->length;)
+    {
+      printf ("%04x ", offset);
+      offset += dbg_disassemble_register (reg, offset);
+    }
+}
+
+void
+dbg_print_stack ()
+{
+  for (value_t *v = vm.stack; v < vm.top; v++)
+    {
+      printf ("[");
+      print_value (*v);
+      printf ("]");
+    }
+  printf ("\n");
+}
+
+void
+dbg_trace (call_t *call)
+{
+  block_t *block = &call->closure->function->block;
+  dbg_print_stack ();
+  dbg_disassemble_operation (block, call->pc - block->code);
+}
+
+void
+dbg_trace_register (call_t *call)
+{
+  reg_block_t *reg = &call->closure->function->reg;
+  dbg_print_stack ();
+  dbg_disassemble_register (reg, call->pc - reg->code);
+}
+
+/* INTERPRET */
+
+bool
+check_top_number ()
+{
+  return value_is_number (vm.top[-1]);
+}
+
+bool
+check_top_2_number ()
+{
+  return value_is_number (vm.top[-2]) && value_is_number (vm.top[-1]);
+}
+
+void
+print_value (value_t v)
+{
+  if (value_is_nil (v))
+    {
+      printf ("nil");
+      return;
+    }
+  if (value_is_boolean (v))
+    {
+      printf (value_as_boolean (v) ? "true" : "false");
+      return;
+    }
+  if (value_is_number (v))
+    {
+      printf ("%g", value_as_number (v));
+      return;
+    }
+
+  switch (value_as_object (v)->type)
+    {
+    case OBJECT_STRING:
+      {
+        string_t *s = (string_t *)value_as_object (v);
+        printf ("\"%s\"", s->chars);
+        break;
+      }
+    case OBJECT_FUNCTION:
+      {
+        function_t *f = (function_t *)value_as_object (v);
+        if (f->name == NULL)
+          printf ("<main>");
+        else
+          printf ("<fn %s>", f->name->chars);
+        break;
+      }
+    case OBJECT_CLOSURE:
+      {
+        closure_t *c = (closure_t *)value_as_object (v);
+        print_value (value_from_object ((object_t *)c->function));
+        break;
+      }
+    case OBJECT_ROPE:
+      {
+        rope_t *r = (rope_t *)value_as_object (v);
+        char *chars = malloc (r->length);
+        if (chars == NULL)
+          exit (1);
+        rope_write (r, chars + r->length);
+        printf ("\"%.*s\"", r->length, chars);
+        free (chars);
+        break;
+      }
+    case OBJECT_UPVALUE:
+      printf ("<upvalue>");
+      break;
+    }
+}
+
+bool
+call_value (value_t callee, int arg_num)
+{
+  if (!value_is_object_type (callee, OBJECT_CLOSURE))
+    {
+      printf ("Can't call '");
+      print_value (callee);
+      printf ("' because it's not a function\n");
+      return false;
+    }
+
+  closure_t *c = (closure_t *)value_as_object (callee);
+  int arity = c->function->arity;
+  if (arity != arg_num)
+    {
+      fprintf (stderr, "Expected %d arguments, got %d\n", arity, arg_num);
+      return false;
+    }
+
+  value_t *slots = vm_reserve_call (c->function, vm.top - arg_num - 1);
+  if (slots == NULL)
+    return false;
+
+  call_t *call = &vm.calls[vm.call_count++];
+  call->closure = c;
+  call->pc = c->function->block.code;
+  call->slots = slots;
+  return true;
+}
+
+/* a call site hitting its cache skips the type and arity checks, which
+   passed when the entry was filled, and starts at the cached entry */
+bool
+call_site (function_t *owner, call_cache_t *cache, int arg_num,
+           bool registers)
+{
+  value_t *slots = vm.top - arg_num - 1;
+  value_t callee = *slots;
+
+  if (value_is_object (callee) && value_as_object (callee) == cache->callee)
+    {
+      closure_t *c = (closure_t *)cache->callee;
+      slots = vm_reserve_call (c->function, slots);
+      if (slots == NULL)
+        return false;
+
+      call_t *call = &vm.calls[vm.call_count++];
+      call->closure = c;
+      call->pc = cache->entry;
+      call->slots = slots;
+      return true;
+    }
+
+  if (!call_value (callee, arg_num))
+    return false;
+
+  call_t *call = &vm.calls[vm.call_count - 1];
+  if (registers)
+    call->pc = call->closure->function->reg.code;
+  cache->callee = (object_t *)call->closure;
+  cache->entry = call->pc;
+  gc_write_barrier ((object_t *)owner, value_from_object (cache->callee));
+  return true;
+}
+
+#define BINARY_OP(o)                                                          \
+  do                                                                          \
+    {                                                                         \
+      if (!check_top_2_number ())                                             \
+        return RESULT_RUNTIME_ERROR;                                          \
+      double b = value_as_number (vm_pop ());                                 \
+      double a = value_as_number (vm_pop ());                                 \
+      vm_push (value_from_number (a o b));                                    \
+    }                                                                         \
+  while (0)
+
+#ifdef THREADED_DISPATCH
+#define DISPATCH() goto *table[op = *call->pc++]
+#define CASE(o)                                                               \
+  case o:                                                                     \
+  label_##o
+#else
+#define DISPATCH() break
+#define CASE(o) case o
+#endif
+
+result_t
+run ()
+{
+  call_t *call = &vm.calls[vm.call_count - 1];
+  value_t *constants = call->closure->function->block.constants.values;
+  call_cache_t *caches = call->closure->function->block.caches;
+  uint8_t op;
+
+#ifdef THREADED_DISPATCH
+  static void *dispatch[] = {
+    [OP_NIL] = &&label_OP_NIL,
+    [OP_TRUE] = &&label_OP_TRUE,
+    [OP_FALSE] = &&label_OP_FALSE,
+    [OP_CONSTANT] = &&label_OP_CONSTANT,
+    [OP_SET_GLOBAL] = &&label_OP_SET_GLOBAL,
+    [OP_GET_GLOBAL] = &&label_OP_GET_GLOBAL,
+    [OP_SET_LOCAL] = &&label_OP_SET_LOCAL,
+    [OP_GET_LOCAL] = &&label_OP_GET_LOCAL,
+    [OP_NEG] = &&label_OP_NEG,
+    [OP_ADD] = &&label_OP_ADD,
+    [OP_SUB] = &&label_OP_SUB,
+    [OP_MUL] = &&label_OP_MUL,
+    [OP_DIV] = &&label_OP_DIV,
+    [OP_MOD] = &&label_OP_MOD,
+    [OP_NOT] = &&label_OP_NOT,
+    [OP_EQ] = &&label_OP_EQ,
+    [OP_CONCAT] = &&label_OP_CONCAT,
+    [OP_PRINT] = &&label_OP_PRINT,
+    [OP_POP] = &&label_OP_POP,
+    [OP_LOOP] = &&label_OP_LOOP,
+    [OP_JUMP] = &&label_OP_JUMP,
+    [OP_JUMP_IF_FALSE] = &&label_OP_JUMP_IF_FALSE,
+    [OP_END_SCOPE] = &&label_OP_END_SCOPE,
+    [OP_CLOSURE] = &&label_OP_CLOSURE,
+    [OP_CALL] = &&label_OP_CALL,
+    [OP_RETURN] = &&label_OP_RETURN,
+    [OP_SET_LOCAL_POP] = &&label_OP_SET_LOCAL_POP,
+    [OP_ADD_LOCALS] = &&label_OP_ADD_LOCALS,
+    [OP_ADD_LOCAL_CONSTANT] = &&label_OP_ADD_LOCAL_CONSTANT,
+    [OP_JUMP_IF_FALSE_POP] = &&label_OP_JUMP_IF_FALSE_POP,
+    [OP_JUMP_IF_TRUE_POP] = &&label_OP_JUMP_IF_TRUE_POP,
+    [OP_GET_UPVALUE] = &&label_OP_GET_UPVALUE,
+    [OP_CLOSE] = &&label_OP_CLOSE,
+    [OP_TAIL_CALL] = &&label_OP_TAIL_CALL,
+  };
+  /* when tracing, every opcode goes through label_trace first, so the
+     untraced table pays nothing for it */
+  static void *dispatch_trace[]
+      = { [OP_NIL... OP_NOT_BUILTIN - 1] = &&label_trace };
+  void **table = trace ? dispatch_trace : dispatch;
+
+  DISPATCH ();
+#endif
+
+  while (1)
+    {
+#ifndef THREADED_DISPATCH
+      if (trace)
+        dbg_trace (call);
+#endif
+
+      switch (op = *call->pc++)
+        {
+#ifdef THREADED_DISPATCH
+        label_trace:
+          call->pc--;
+          dbg_trace (call);
+          call->pc++;
+          goto *dispatch[op];
+#endif
+        CASE (OP_NIL):
+          vm_push (value_nil ());
+          DISPATCH ();
+        CASE (OP_TRUE):
+          vm_push (value_from_boolean (true));
+          DISPATCH ();
+        CASE (OP_FALSE):
+          vm_push (value_from_boolean (false));
+          DISPATCH ();
+        CASE (OP_CONSTANT):
+          {
+            vm_push (constants[*call->pc++]);
+            DISPATCH ();
+          }
+        CASE (OP_SET_GLOBAL):
+          {
+            uint16_t slot = (call->pc[0] << 8) | call->pc[1];
+            call->pc += 2;
+            gc_set_global (slot, vm_pop ());
+            DISPATCH ();
+          }
+        CASE (OP_GET_GLOBAL):
+          {
+            uint16_t slot = (call->pc[0] << 8) | call->pc[1];
+            call->pc += 2;
+            vm_push (vm.global_values.values[slot]);
+            DISPATCH ();
+          }
+        CASE (OP_SET_LOCAL):
+          {
+            uint8_t offset = *call->pc++;
+            call->slots[offset] = vm_peek ();
+            DISPATCH ();
+          }
+        CASE (OP_GET_LOCAL):
+          {
+            uint8_t offset = *call->pc++;
+            vm_push (call->slots[offset]);
+            DISPATCH ();
+          }
+        CASE (OP_NEG):
+          {
+            if (!check_top_number ())
+              return RESULT_RUNTIME_ERROR;
+            vm_push (value_from_number (-value_as_number (vm_pop ())));
+            DISPATCH ();
+          }
+        CASE (OP_ADD):
+          BINARY_OP (+);
+          DISPATCH ();
+        CASE (OP_SUB):
+          BINARY_OP (-);
+          DISPATCH ();
+        CASE (OP_MUL):
+          BINARY_OP (*);
+          DISPATCH ();
+        CASE (OP_DIV):
+          BINARY_OP (/);
+          DISPATCH ();
+        CASE (OP_MOD):
+          {
+            if (!check_top_2_number ())
+              return RESULT_RUNTIME_ERROR;
+            double b = value_as_number (vm_pop ());
+            double a = value_as_number (vm_pop ());
+            vm_push (value_from_number (fmod (a, b)));
+            DISPATCH ();
+          }
+        CASE (OP_NOT):
+          {
+            vm_push (value_from_boolean (!value_to_boolean (vm_pop ())));
+            DISPATCH ();
+          }
+        CASE (OP_EQ):
+          {
+            rope_flatten_value (&vm.top[-1]);
+            rope_flatten_value (&vm.top[-2]);
+            value_t b = vm_pop ();
+            value_t a = vm_pop ();
+            bool result = value_are_equal (a, b);
+            vm_push (value_from_boolean (result));
+            DISPATCH ();
+          }
+        CASE (OP_CONCAT):
+          {
+            if (!value_is_text (vm.top[-2]) || !value_is_text (vm.top[-1]))
+              return RESULT_RUNTIME_ERROR;
+
+            object_t *b = value_as_object (vm_pop ());
+            object_t *a = value_as_object (vm_pop ());
+
+            vm_push (value_from_object (rope_concat (a, b)));
+            DISPATCH ();
+          }
+        CASE (OP_PRINT):
+          {
+            rope_flatten_value (&vm.top[-1]);
+            print_value (vm_pop ());
+            printf ("\n");
+            DISPATCH ();
+          }
+        CASE (OP_POP):
+          {
+            vm_pop ();
+            DISPATCH ();
+          }
+        CASE (OP_LOOP):
+          {
+            call->pc += 2;
+            uint16_t offset = (call->pc[-2] << 8) | call->pc[-1];
+            call->pc -= offset;
+            /* a body can leave values behind, so each turn has to find
+               room for another */
+            size_t needed = vm.top - vm.stack
+                            + call->closure->function->stack_size
+                            + STACK_HEADROOM;
+            if (vm.stack + needed > vm.stack_end && !vm_stack_grow (needed))
+              {
+                fprintf (stderr, "Stack overflow\n");
+                return RESULT_RUNTIME_ERROR;
+              }
+            DISPATCH ();
+          }
+        CASE (OP_JUMP):
+          {
+            call->pc += 2;
+            uint16_t offset = (call->pc[-2] << 8) | call->pc[-1];
+            call->pc += offset;
+            DISPATCH ();
+          }
+        CASE (OP_JUMP_IF_FALSE):
+          {
+            call->pc += 2;
+            uint16_t offset = (call->pc[-2] << 8) | call->pc[-1];
+            if (!value_to_boolean (vm_peek ()))
+              call->pc += offset;
+            DISPATCH ();
+          }
+        CASE (OP_END_SCOPE):
+          {
+            uint8_t n = *call->pc++;
+            *(vm.top - n - 1) = vm_peek ();
+            vm.top -= n;
+            DISPATCH ();
+          }
+        CASE (OP_CLOSURE):
+          {
+            value_t v = constants[*call->pc++];
+            function_t *f = (function_t *)value_as_object (v);
+            closure_t *c = closure_new (f);
+            object_t *o = (object_t *)c;
+            vm_push (value_from_object (o));
+            closure_capture (&vm.top[-1], call);
+            DISPATCH ();
+          }
+        CASE (OP_CALL):
+          {
+            uint8_t arg_num = call->pc[0];
+            call_cache_t *cache = &caches[(call->pc[1] << 8) | call->pc[2]];
+            call->pc += 3;
+            if (!call_site (call->closure->function, cache, arg_num, false))
+              return RESULT_RUNTIME_ERROR;
+            call = &vm.calls[vm.call_count - 1];
+            constants = call->closure->function->block.constants.values;
+            caches = call->closure->function->block.caches;
+            DISPATCH ();
+          }
+        CASE (OP_RETURN):
+          {
+            value_t v = vm_pop ();
+            vm.call_count--;
+            if (vm.call_count == 0)
+              return RESULT_OK;
+
+            vm.top = call->slots;
+            vm_push (v);
+            call = &vm.calls[vm.call_count - 1];
+            constants = call->closure->function->block.constants.values;
+            caches = call->closure->function->block.caches;
+            DISPATCH ();
+          }
+        CASE (OP_SET_LOCAL_POP):
+          {
+            uint8_t offset = *call->pc++;
+            call->slots[offset] = vm_pop ();
+            DISPATCH ();
+          }
+        CASE (OP_ADD_LOCALS):
+          {
+            value_t a = call->slots[call->pc[0]];
+            value_t b = call->slots[call->pc[1]];
+            call->pc += 2;
+            if (!value_is_number (a) || !value_is_number (b))
+              return RESULT_RUNTIME_ERROR;
+            vm_push (value_from_number (value_as_number (a)
+                                        + value_as_number (b)));
+            DISPATCH ();
+          }
+        CASE (OP_ADD_LOCAL_CONSTANT):
+          {
+            value_t a = call->slots[call->pc[0]];
+            value_t b = constants[call->pc[1]];
+            call->pc += 2;
+            if (!value_is_number (a) || !value_is_number (b))
+              return RESULT_RUNTIME_ERROR;
+            vm_push (value_from_number (value_as_number (a)
+                                        + value_as_number (b)));
+            DISPATCH ();
+          }
+        CASE (OP_JUMP_IF_FALSE_POP):
+          {
+            call->pc += 2;
+            uint16_t offset = (call->pc[-2] << 8) | call->pc[-1];
+            if (!value_to_boolean (vm_pop ()))
+              call->pc += offset;
+            DISPATCH ();
+          }
+        CASE (OP_JUMP_IF_TRUE_POP):
+          {
+            call->pc += 2;
+            uint16_t offset = (call->pc[-2] << 8) | call->pc[-1];
+            if (value_to_boolean (vm_pop ()))
+              call->pc += offset;
+            DISPATCH ();
+          }
+        CASE (OP_GET_UPVALUE):
+          {
+            uint8_t n = *call->pc++;
+            vm_push (*call->closure->upvalues[n]->location);
+            DISPATCH ();
+          }
+        CASE (OP_CLOSE):
+          {
+            upvalue_close (call->slots + *call->pc++);
+            DISPATCH ();
+          }
+        CASE (OP_TAIL_CALL):
+          {
+            uint8_t arg_num = call->pc[0];
+            call_cache_t *cache = &caches[(call->pc[1] << 8) | call->pc[2]];
+            call->pc += 3;
+            function_t *owner = call->closure->function;
+
+            /* the callee and its arguments take over this frame */
+            upvalue_close (call->slots);
+            value_t *callee = vm.top - arg_num - 1;
+            memmove (call->slots, callee, (arg_num + 1) * sizeof (value_t));
+            vm.top = call->slots + arg_num + 1;
+            vm.call_count--;
+
+            if (!call_site (owner, cache, arg_num, false))
+              return RESULT_RUNTIME_ERROR;
+            call = &vm.calls[vm.call_count - 1];
+            constants = call->closure->function->block.constants.values;
+            caches = call->closure->function->block.caches;
+            DISPATCH ();
+          }
+        }
+    }
+}
+
+#define REG_BINARY_OP(o, source)                                              \
+  do                                                                          \
+    {                                                                         \
+      uint8_t a = *call->pc++;                                                \
+      value_t b = call->slots[*call->pc++];                                   \
+      value_t c = source[*call->pc++];                                        \
+      if (!value_is_number (b) || !value_is_number (c))                       \
+        return RESULT_RUNTIME_ERROR;                                          \
+      call->slots[a]                                                          \
+          = value_from_number (value_as_number (b) o value_as_number (c));    \
+    }                                                                         \
+  while (0)
+
+#define REG_MOD_OP(source)                                                    \
+  do                                                                          \
+    {                                                                         \
+      uint8_t a = *call->pc++;                                                \
+      value_t b = call->slots[*call->pc++];                                   \
+      value_t c = source[*call->pc++];                                        \
+      if (!value_is_number (b) || !value_is_number (c))                       \
+        return RESULT_RUNTIME_ERROR;                                          \
+      call->slots[a]                                                          \
+          = value_from_number (fmod (value_as_number (b), value_as_number (c))); \
+    }                                                                         \
+  while (0)
+
+#define REG_EQ_OP(source)                                                     \
+  do                                                                          \
+    {                                                                         \
+      uint8_t a = *call->pc++;                                                \
+      value_t *b = &call->slots[*call->pc++];                                 \
+      value_t *c = &source[*call->pc++];                                      \
+      rope_flatten_value (b);                                                 \
+      rope_flatten_value (c);                                                 \
+      call->slots[a] = value_from_boolean (value_are_equal (*b, *c));         \
+    }                                                                         \
+  while (0)
+
+/* registers below vm.top are what the collector scans, so in register mode
+   it only ever grows: slots left above a returning frame still hold values
+   that were live when written, and slots exposed for the first time are
+   cleared so a stale pointer is never traced */
+value_t *
+reg_expose (call_t *call)
+{
+  value_t *frame_top = call->slots + call->closure->function->reg.frame_size;
+  value_t *top = vm.top;
+  while (top < frame_top)
+    *top++ = value_nil ();
+  return top;
+}
+
+result_t
+run_reg ()
+{
+  call_t *call = &vm.calls[vm.call_count - 1];
+  value_t *constants = call->closure->function->block.constants.values;
+  call_cache_t *caches = call->closure->function->block.caches;
+  uint8_t op;
+
+  vm.top = reg_expose (call);
+
+#ifdef THREADED_DISPATCH
+  static void *dispatch[] = {
+    [ROP_MOVE] = &&label_ROP_MOVE,
+    [ROP_LOADK] = &&label_ROP_LOADK,
+    [ROP_NIL] = &&label_ROP_NIL,
+    [ROP_TRUE] = &&label_ROP_TRUE,
+    [ROP_FALSE] = &&label_ROP_FALSE,
+    [ROP_SET_GLOBAL] = &&label_ROP_SET_GLOBAL,
+    [ROP_GET_GLOBAL] = &&label_ROP_GET_GLOBAL,
+    [ROP_NEG] = &&label_ROP_NEG,
+    [ROP_NOT] = &&label_ROP_NOT,
+    [ROP_ADD] = &&label_ROP_ADD,
+    [ROP_SUB] = &&label_ROP_SUB,
+    [ROP_MUL] = &&label_ROP_MUL,
+    [ROP_DIV] = &&label_ROP_DIV,
+    [ROP_MOD] = &&label_ROP_MOD,
+    [ROP_EQ] = &&label_ROP_EQ,
+    [ROP_CONCAT] = &&label_ROP_CONCAT,
+    [ROP_ADDK] = &&label_ROP_ADDK,
+    [ROP_SUBK] = &&label_ROP_SUBK,
+    [ROP_MULK] = &&label_ROP_MULK,
+    [ROP_DIVK] = &&label_ROP_DIVK,
+    [ROP_MODK] = &&label_ROP_MODK,
+    [ROP_EQK] = &&label_ROP_EQK,
+    [ROP_PRINT] = &&label_ROP_PRINT,
+    [ROP_LOOP] = &&label_ROP_LOOP,
+    [ROP_JUMP] = &&label_ROP_JUMP,
+    [ROP_JUMP_IF_FALSE] = &&label_ROP_JUMP_IF_FALSE,
+    [ROP_GET_UPVALUE] = &&label_ROP_GET_UPVALUE,
+    [ROP_CLOSE] = &&label_ROP_CLOSE,
+    [ROP_CLOSURE] = &&label_ROP_CLOSURE,
+    [ROP_CALL] = &&label_ROP_CALL,
+    [ROP_TAIL_CALL] = &&label_ROP_TAIL_CALL,
+    [ROP_RETURN] = &&label_ROP_RETURN,
+  };
+  static void *dispatch_trace[] = { [ROP_MOVE... ROP_RETURN] = &&label_trace };
+  void **table = trace ? dispatch_trace : dispatch;
+
+  DISPATCH ();
+#endif
+
+  while (1)
+    {
+#ifndef THREADED_DISPATCH
+      if (trace)
+        dbg_trace_register (call);
+#endif
+
+      switch (op = *call->pc++)
+        {
+#ifdef THREADED_DISPATCH
+        label_trace:
+          call->pc--;
+          dbg_trace_register (call);
+          call->pc++;
+          goto *dispatch[op];
+#endif
+        CASE (ROP_MOVE):
+          {
+            uint8_t a = *call->pc++;
+            call->slots[a] = call->slots[*call->pc++];
+            DISPATCH ();
+          }
+        CASE (ROP_LOADK):
+          {
+            uint8_t a = *call->pc++;
+            call->slots[a] = constants[*call->pc++];
+            DISPATCH ();
+          }
+        CASE (ROP_NIL):
+          call->slots[*call->pc++] = value_nil ();
+          DISPATCH ();
+        CASE (ROP_TRUE):
+          call->slots[*call->pc++] = value_from_boolean (true);
+          DISPATCH ();
+        CASE (ROP_FALSE):
+          call->slots[*call->pc++] = value_from_boolean (false);
+          DISPATCH ();
+        CASE (ROP_SET_GLOBAL):
+          {
+            uint16_t slot = (call->pc[0] << 8) | call->pc[1];
+            gc_set_global (slot, call->slots[call->pc[2]]);
+            call->pc += 3;
+            DISPATCH ();
+          }
+        CASE (ROP_GET_GLOBAL):
+          {
+            uint8_t a = *call->pc++;
+            uint16_t slot = (call->pc[0] << 8) | call->pc[1];
+            call->pc += 2;
+            call->slots[a] = vm.global_values.values[slot];
+            DISPATCH ();
+          }
+        CASE (ROP_NEG):
+          {
+            uint8_t a = *call->pc++;
+            value_t b = call->slots[*call->pc++];
+            if (!value_is_number (b))
+              return RESULT_RUNTIME_ERROR;
+            call->slots[a] = value_from_number (-value_as_number (b));
+            DISPATCH ();
+          }
+        CASE (ROP_NOT):
+          {
+            uint8_t a = *call->pc++;
+            value_t b = call->slots[*call->pc++];
+            call->slots[a] = value_from_boolean (!value_to_boolean (b));
+            DISPATCH ();
+          }
+        CASE (ROP_ADD):
+          REG_BINARY_OP (+, call->slots);
+          DISPATCH ();
+        CASE (ROP_SUB):
+          REG_BINARY_OP (-, call->slots);
+          DISPATCH ();
+        CASE (ROP_MUL):
+          REG_BINARY_OP (*, call->slots);
+          DISPATCH ();
+        CASE (ROP_DIV):
+          REG_BINARY_OP (/, call->slots);
+          DISPATCH ();
+        CASE (ROP_MOD):
+          REG_MOD_OP (call->slots);
+          DISPATCH ();
+        CASE (ROP_EQ):
+          REG_EQ_OP (call->slots);
+          DISPATCH ();
+        CASE (ROP_ADDK):
+          REG_BINARY_OP (+, constants);
+          DISPATCH ();
+        CASE (ROP_SUBK):
+          REG_BINARY_OP (-, constants);
+          DISPATCH ();
+        CASE (ROP_MULK):
+          REG_BINARY_OP (*, constants);
+          DISPATCH ();
+        CASE (ROP_DIVK):
+          REG_BINARY_OP (/, constants);
+          DISPATCH ();
+        CASE (ROP_MODK):
+          REG_MOD_OP (constants);
+          DISPATCH ();
+        CASE (ROP_EQK):
+          REG_EQ_OP (constants);
+          DISPATCH ();
+        CASE (ROP_CONCAT):
+          {
+            uint8_t a = *call->pc++;
+            value_t b = call->slots[*call->pc++];
+            value_t c = call->slots[*call->pc++];
+            if (!value_is_text (b) || !value_is_text (c))
+              return RESULT_RUNTIME_ERROR;
+
+            object_t *o
+                = rope_concat (value_as_object (b), value_as_object (c));
+            call->slots[a] = value_from_object (o);
+            DISPATCH ();
+          }
+        CASE (ROP_PRINT):
+          {
+            value_t *v = &call->slots[*call->pc++];
+            rope_flatten_value (v);
+            print_value (*v);
+            printf ("\n");
+            DISPATCH ();
+          }
+        CASE (ROP_LOOP):
+          {
+            call->pc += 2;
+            uint16_t offset = (call->pc[-2] << 8) | call->pc[-1];
+            call->pc -= offset;
+            DISPATCH ();
+          }
+        CASE (ROP_JUMP):
+          {
+            call->pc += 2;
+            uint16_t offset = (call->pc[-2] << 8) | call->pc[-1];
+            call->pc += offset;
+            DISPATCH ();
+          }
+        CASE (ROP_JUMP_IF_FALSE):
+          {
+            value_t v = call->slots[*call->pc++];
+            call->pc += 2;
+            uint16_t offset = (call->pc[-2] << 8) | call->pc[-1];
+            if (!value_to_boolean (v))
+              call->pc += offset;
+            DISPATCH ();
+          }
+        CASE (ROP_CLOSURE):
+          {
+            uint8_t a = *call->pc++;
+            value_t v = constants[*call->pc++];
+            function_t *f = (function_t *)value_as_object (v);
+            call->slots[a] = value_from_object ((object_t *)closure_new (f));
+            closure_capture (&call->slots[a], call);
+            DISPATCH ();
+          }
+        CASE (ROP_GET_UPVALUE):
+          {
+            uint8_t a = *call->pc++;
+            call->slots[a] = *call->closure->upvalues[*call->pc++]->location;
+            DISPATCH ();
+          }
+        CASE (ROP_CLOSE):
+          {
+            upvalue_close (call->slots + *call->pc++);
+            DISPATCH ();
+          }
+        CASE (ROP_CALL):
+          {
+            uint8_t a = call->pc[0];
+            uint8_t arg_num = call->pc[1];
+            call_cache_t *cache = &caches[(call->pc[2] << 8) | call->pc[3]];
+            call->pc += 4;
+            /* kept as an offset, the stack can move during the call */
+            size_t top = vm.top - vm.stack;
+            vm.top = call->slots + a + arg_num + 1;
+            if (!call_site (call->closure->function, cache, arg_num, true))
+              return RESULT_RUNTIME_ERROR;
+            call = &vm.calls[vm.call_count - 1];
+            vm.top = vm.stack + top;
+            vm.top = reg_expose (call);
+            constants = call->closure->function->block.constants.values;
+            caches = call->closure->function->block.caches;
+            DISPATCH ();
+          }
+        CASE (ROP_TAIL_CALL):
+          {
+            uint8_t a = call->pc[0];
+            uint8_t arg_num = call->pc[1];
+            call_cache_t *cache = &caches[(call->pc[2] << 8) | call->pc[3]];
+            call->pc += 4;
+            function_t *owner = call->closure->function;
+
+            upvalue_close (call->slots);
+            memmove (call->slots, call->slots + a,
+                     (arg_num + 1) * sizeof (value_t));
+            /* kept as an offset, the stack can move during the call */
+            size_t top = vm.top - vm.stack;
+            vm.top = call->slots + arg_num + 1;
+            vm.call_count--;
+
+            if (!call_site (owner, cache, arg_num, true))
+              return RESULT_RUNTIME_ERROR;
+            call = &vm.calls[vm.call_count - 1];
+            vm.top = vm.stack + top;
+            vm.top = reg_expose (call);
+            constants = call->closure->function->block.constants.values;
+            caches = call->closure->function->block.caches;
+            DISPATCH ();
+          }
+        CASE (ROP_RETURN):
+          {
+            value_t v = call->slots[*call->pc++];
+            vm.call_count--;
+            if (vm.call_count == 0)
+              return RESULT_OK;
+
+            *call->slots = v;
+            call = &vm.calls[vm.call_count - 1];
+            constants = call->closure->function->block.constants.values;
+            caches = call->closure->function->block.caches;
+            DISPATCH ();
+          }
+        }
+    }
+}
+
+void
+scan_new (const char *source)
+{
+  scan.start = source;
+  scan.current = source;
+}
+
+bool
+is_whitespace (char c)
+{
+  return c == ' ' || c == '\r' || c == '\n' || c == '\t';
+}
+
+bool
+is_word (char c)
+{
+  return c != '(' && c != ')' && c != '\0' && !is_whitespace (c);
+}
+
+bool
+is_digit (char c)
+{
+  return '0' <= c && c <= '9';
+}
+
+bool
+is_number (const char *word_start, const char *word_end)
+{
+  const char *c = word_start;
+
+  while (is_digit (*c) && c < word_end)
+    c++;
+
+  return c == word_end;
+}
+
+void
+ignore_whitespace ()
+{
+  while (1)
+    {
+      char c = *scan.current;
+      if (!is_whitespace (c))
+        return;
+      scan.current++;
+    }
+}
+
+token_t
+token_create (token_type_t type)
+{
+  token_t token = { .type = type,
+                    .start = scan.start,
+                    .length = scan.current - scan.start };
+  return token;
+}
+
+token_t
+token_create_string ()
+{
+  char p = '"';
+  char c;
+  token_t t;
+  while (1)
+    {
+      if ((c = *scan.current++) == '\0')
+        {
+          fprintf (stderr, "Missing quote in string");
+          exit (1);
+        }
+      if (p != '\\' && c == '"')
+        break;
+      p = c;
+    }
+  t = token_create (TOKEN_STRING);
+  t.start += 1;
+  t.length -= 2;
+  return t;
+}
+
+token_t
+scan_token ()
+{
+  ignore_whitespace ();
+  scan.start = scan.current;
+
+  if (*scan.current == '\0')
+    return token_create (TOKEN_END);
+
+  char c = *scan.current++;
+  switch (c)
+    {
+    case '(':
+      return token_create (TOKEN_LPAREN);
+    case ')':
+      return token_create (TOKEN_RPAREN);
+    case '"':
+      return token_create_string ();
+    }
+
+  while (is_word (*scan.current))
+    scan.current++;
+
+  if (is_number (scan.start, scan.current))
+    return token_create (TOKEN_NUMBER);
+
+  return token_create (TOKEN_WORD);
+}
+
+bool
+is_token_string (token_t token, const char *str)
+{
+  int len = strlen (str);
+  bool same_len = token.length == len;
+  bool same_str = 0 == strncmp (str, token.start, len);
+  return same_str && same_len;
+}
+
+bool
+is_token_equal_to (token_t *a, token_t *b)
+{
+  if (a->length != b->length)
+    return false;
+  return memcmp (a->start, b->start, a->length) == 0;
+}
+
+opcode_t
+is_token_op (token_t token)
+{
+  if (token.length == 1)
+    {
+      switch (*token.start)
+        {
+        case '+':
+          return OP_ADD;
+        case '-':
+          return OP_SUB;
+        case '*':
+          return OP_MUL;
+        case '/':
+          return OP_DIV;
+        case '%':
+          return OP_MOD;
+        case '=':
+          return OP_EQ;
+        }
+    }
+  if (is_token_string (token, ".."))
+    return OP_CONCAT;
+  if (is_token_string (token, "print"))
+    return OP_PRINT;
+  if (is_token_string (token, "not"))
+    return OP_NOT;
+  if (is_token_string (token, "nil"))
+    return OP_NIL;
+  if (is_token_string (token, "true"))
+    return OP_TRUE;
+  if (is_token_string (token, "false"))
+    return OP_FALSE;
+
+  return OP_NOT_BUILTIN;
+}
+
+void
+local_set_new (token_t token)
+{
+  local_t *local = &current->locals[current->local_count++];
+  local->name = token;
+  local->depth = current->scope_depth;
+  local->captured = false;
+}
+
+void
+emit_set_local (token_t token)
+{
+  if (current->local_count == UINT8_OVER)
+    {
+      fprintf (stderr, "Too many locals\n");
+      return;
+    }
+
+  for (int i = current->local_count - 1; i >= 0; i--)
+    {
+      local_t *local = &current->locals[i];
+      if (local->depth != -1 && local->depth < current->scope_depth)
+        break;
+
+      if (is_token_equal_to (&token, &local->name))
+        {
+          block_push (OP_SET_LOCAL);
+          block_push (i);
+          block_push (OP_POP);
+          return;
+        }
+    }
+
+  local_set_new (token);
+  block_push (OP_SET_LOCAL);
+  block_push (current->local_count - 1);
+}
+
+int
+find_local (compiler_t *compiler, token_t *token)
+{
+  for (int i = compiler->local_count - 1; i >= 0; i--)
+    {
+      local_t *local = &compiler->locals[i];
+      if (is_token_equal_to (token, &local->name))
+        return i;
+    }
+  return -1;
+}
+
+int
+add_upvalue (compiler_t *compiler, uint8_t index, bool is_local)
+{
+  for (int i = 0; i < compiler->upvalue_count; i++)
+    {
+      capture_t *capture = &compiler->upvalues[i];
+      if (capture->index == index && capture->is_local == is_local)
+        return i;
+    }
+
+  if (compiler->upvalue_count == UINT8_OVER)
+    {
+      fprintf (stderr, "Too many captured variables\n");
+      return -1;
+    }
+
+  compiler->upvalues[compiler->upvalue_count]
+      = (capture_t){ .index = index, .is_local = is_local };
+  return compiler->upvalue_count++;
+}
+
+/* a name that isn't a local may belong to an enclosing function, which then
+   has to keep the local for the closure */
+int
+find_upvalue (compiler_t *compiler, token_t *token)
+{
+  if (compiler->outer == NULL)
+    return -1;
+
+  int local = find_local (compiler->outer, token);
+  if (local != -1)
+    {
+      compiler->outer->locals[local].captured = true;
+      return add_upvalue (compiler, local, true);
+    }
+
+  int upvalue = find_upvalue (compiler->outer, token);
+  if (upvalue != -1)
+    return add_upvalue (compiler, upvalue, false);
+  return -1;
+}
+
+bool
+emit_get_local (token_t token)
+{
+  int n = find_local (current, &token);
+  if (n != -1)
+    {
+      block_push (OP_GET_LOCAL);
+      block_push (n);
+      return true;
+    }
+
+  n = find_upvalue (current, &token);
+  if (n == -1)
+    {
+      fprintf (stderr, "Couldn't find '%.*s'\n", token.length, token.start);
+      return false;
+    }
+
+  block_push (OP_GET_UPVALUE);
+  block_push (n);
+  return true;
+}
+
+void
+emit_global (opcode_t op, int slot)
+{
+  block_push (op);
+  block_push ((slot >> 8) & 0xff);
+  block_push (slot & 0xff);
+}
+
+/* names are interned, so one that isn't can't be a global yet; looking it
+   up by its characters saves allocating a string per reference */
+int
+find_global (token_t token)
+{
+  uint32_t hash = hash_from_string (token.start, token.length);
+  string_t *s = table_find_string (&vm.strings, token.start, token.length,
+                                   "", 0, hash);
+  return s == NULL ? -1 : global_find (s);
+}
+
+/* globals get their slot when a store to them is first compiled, so reads
+   further down the source resolve even before the store has run */
+int
+declare_global (token_t token)
+{
+  int slot = find_global (token);
+  if (slot != -1)
+    return slot;
+
+  string_t *s = string_allocate ((char *)token.start, token.length);
+  return global_declare (s);
+}
+
+void
+emit_set_global (token_t token)
+{
+  emit_global (OP_SET_GLOBAL, declare_global (token));
+}
+
+bool
+emit_get_global (token_t token)
+{
+  int slot = find_global (token);
+  if (slot == -1)
+    {
+      fprintf (stderr, "Couldn't find '%.*s'\n", token.length, token.start);
+      return false;
+    }
+
+  emit_global (OP_GET_GLOBAL, slot);
+  return true;
+}
+
+bool
+emit_word (token_t token)
+{
+  bool found = (*token.start == '_') ? emit_get_global (token)
+                                     : emit_get_local (token);
+
+  if (trace)
+    printf ("emit word '%.*s'\n", token.length, token.start);
+  return found;
+}
+
+bool
+emit_op (token_t token, int arg_num)
+{
+  opcode_t op = is_token_op (token);
+  if (op == OP_NOT_BUILTIN)
+    {
+      if (arg_num > 255)
+        {
+          fprintf (stderr, "Functions cannot have >255 parameters\n");
+          return false;
+        }
+
+      int cache = block_add_call_cache ();
+      block_push (OP_CALL);
+      block_push (arg_num);
+      block_push (cache >> 8);
+      block_push (cache & 0xff);
+      return true;
+    }
+
+  block_push (op);
+
+  if (trace)
+    printf ("emit op '%.*s'\n", token.length, token.start);
+  return true;
+}
+
+bool
+literal_at (block_t *block, int offset, value_t *v)
+{
+  switch (block->code[offset])
+    {
+    case OP_CONSTANT:
+      *v = block->constants.values[block->code[offset + 1]];
+      return true;
+    case OP_NIL:
+      *v = value_nil ();
+      return true;
+    case OP_TRUE:
+      *v = value_from_boolean (true);
+      return true;
+    case OP_FALSE:
+      *v = value_from_boolean (false);
+      return true;
+    default:
+      return false;
+    }
+}
+
+bool
+fold_value (opcode_t op, value_t a, value_t b, value_t *result)
+{
+  if (op == OP_NOT)
+    {
+      *result = value_from_boolean (!value_to_boolean (a));
+      return true;
+    }
+  if (op == OP_EQ)
+    {
+      *result = value_from_boolean (value_are_equal (a, b));
+      return true;
+    }
+  if (op == OP_CONCAT)
+    {
+      if (!value_is_object_type (a, OBJECT_STRING)
+          || !value_is_object_type (b, OBJECT_STRING))
+        return false;
+      string_t *sa = (string_t *)value_as_object (a);
+      string_t *sb = (string_t *)value_as_object (b);
+      string_t *s = string_concat (sa, sb, true);
+      *result = value_from_object ((object_t *)s);
+      return true;
+    }
+
+  /* type errors are left for the VM to report */
+  if (!value_is_number (a) || !value_is_number (b))
+    return false;
+
+  double x = value_as_number (a);
+  double y = value_as_number (b);
+  switch (op)
+    {
+    case OP_ADD:
+      *result = value_from_number (x + y);
+      return true;
+    case OP_SUB:
+      *result = value_from_number (x - y);
+      return true;
+    case OP_MUL:
+      *result = value_from_number (x * y);
+      return true;
+    case OP_DIV:
+      *result = value_from_number (x / y);
+      return true;
+    case OP_MOD:
+      *result = value_from_number (fmod (x, y));
+      return true;
+    default:
+      return false;
+    }
+}
+
+/* evaluate a builtin whose operands are all literals at compile time,
+   replacing the operand loads emitted since 'start' with the result */
+bool
+fold_op (token_t token, int start, int arg_num)
+{
+  block_t *block = get_block ();
+  opcode_t op = is_token_op (token);
+  /* not reads only args[0]; the other is nil rather than garbage */
+  value_t args[2] = { value_nil (), value_nil () };
+  int offset = start;
+
+  switch (op)
+    {
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_EQ:
+    case OP_CONCAT:
+      if (arg_num != 2)
+        return false;
+      break;
+    case OP_NOT:
+      if (arg_num != 1)
+        return false;
+      break;
+    default:
+      return false;
+    }
+
+  for (int i = 0; i < arg_num; i++)
+    {
+      if (offset >= block->length || !literal_at (block, offset, &args[i]))
+        return false;
+      offset += op_length (block->code[offset]);
+    }
+  if (offset != block->length)
+    return false;
+
+  value_t result;
+  if (!fold_value (op, args[0], args[1], &result))
+    return false;
+
+  block->length = start;
+  if (value_is_boolean (result))
+    block_push (value_as_boolean (result) ? OP_TRUE : OP_FALSE);
+  else
+    block_push_constant (result, OP_CONSTANT);
+
+  if (trace)
+    printf ("fold op '%.*s'\n", token.length, token.start);
+  return true;
+}
+
+void
+emit_number (token_t token)
+{
+  double n = strtod (token.start, NULL);
+
+  block_push_constant (value_from_number (n), OP_CONSTANT);
+}
+
+void
+emit_string (token_t token)
+{
+  string_t *s = string_allocate ((char *)token.start, token.length);
+  value_t v = value_from_object ((object_t *)s);
+
+  block_push_constant (v, OP_CONSTANT);
+
+  if (trace)
+    printf ("string '%.*s'\n", token.length, token.start);
+}
+
+bool parse_expression (token_t token);
+
+bool
+parse_multiple_expressions (token_t token, int *counter)
+{
+  do
+    {
+      token = scan_token ();
+      if (token.type == TOKEN_RPAREN || token.type == TOKEN_END)
+        break;
+      if (!parse_expression (token))
+        return false;
+      (*counter)++;
+    }
+  while (1);
+
+  if (token.type != TOKEN_RPAREN)
+    {
+      fprintf (stderr, "Missing ')'\n");
+      return false;
+    }
+
+  return true;
+}
+
+bool
+parse_do_form (token_t token)
+{
+  int arg_num = 0;
+  compiler_scope_create ();
+
+  if (!parse_multiple_expressions (token, &arg_num))
+    return false;
+
+  compiler_scope_delete ();
+  return true;
+}
+
+bool
+parse_on_form ()
+{
+  token_t next_token = scan_token ();
+  token_t name;
+  int body_expr_num;
+
+  compiler_t compiler;
+  compiler_new (&compiler, FUNCTION_USER_DEFINED);
+  compiler_scope_create ();
+
+  if (next_token.type != TOKEN_LPAREN)
+    {
+      fprintf (stderr, "Expected '(' to begin function declaration\n");
+      return false;
+    }
+
+  next_token = scan_token ();
+  if (next_token.type != TOKEN_WORD)
+    {
+      fprintf (stderr, "Expected name within function declaration\n");
+      return false;
+    }
+
+  name = next_token;
+  bool is_global = *name.start == '_';
+  /* declare a global name up front so the body can call itself */
+  if (is_global)
+    declare_global (name);
+
+  while ((next_token = scan_token ()).type == TOKEN_WORD)
+    {
+      current->function->arity++;
+      if (current->function->arity > 255)
+        {
+          fprintf (stderr, "Functions cannot have >255 parameters\n");
+          return false;
+        }
+
+      local_set_new (next_token);
+    }
+
+  if (next_token.type != TOKEN_RPAREN)
+    {
+      fprintf (stderr, "Expected ')' to end function declaration\n");
+      return false;
+    }
+
+  parse_multiple_expressions (next_token, &body_expr_num);
+
+  /* name the function while it's still rooted by the compiler */
+  function_t *named = current->function;
+  named->name = string_allocate ((char *)name.start, name.length);
+  gc_write_barrier ((object_t *)named,
+                    value_from_object ((object_t *)named->name));
+  function_t *f = compiler_end ();
+
+  if (!function_finish (f))
+    return false;
+  block_finish (&f->block);
+
+  value_t v = value_from_object ((object_t *)f);
+  if (f->upvalue_count > 0)
+    block_push_constant (v, OP_CLOSURE);
+  else
+    {
+      /* nothing to capture, so every run of the form can share one closure,
+         made now and loaded as a constant */
+      vm_push (v);
+      closure_t *c = closure_new (f);
+      vm_pop ();
+      block_push_constant (value_from_object ((object_t *)c), OP_CONSTANT);
+    }
+  if (is_global)
+    emit_set_global (name);
+  else
+    emit_set_local (name);
+
+  return true;
+}
+
+bool
+parse_put_form ()
+{
+  token_t key = scan_token ();
+  token_t next_token = scan_token ();
+
+  if (key.type != TOKEN_WORD)
+    {
+      fprintf (stderr, "First argument to 'put' must be a word\n");
+      return false;
+    }
+
+  if (next_token.type == TOKEN_END)
+    {
+      fprintf (stderr, "Unexpected EOF\n");
+      return false;
+    }
+
+  if (next_token.type == TOKEN_RPAREN)
+    block_push (OP_NIL);
+  else if (!parse_expression (next_token))
+    return false;
+
+  next_token = scan_token ();
+  if (next_token.type != TOKEN_RPAREN)
+    {
+      fprintf (stderr, "Missing ')' or too much arguments for 'put'\n");
+      return false;
+    }
+
+  // if key starts with '_', make it global
+  if (*key.start == '_')
+    emit_set_global (key);
+  else
+    emit_set_local (key);
+
+  return true;
+}
+
+int
+emit_jump (opcode_t op)
+{
+  block_t *block = get_block ();
+  block_push (op);
+  block_push (0);
+  block_push (0);
+  return block->length - 2;
+}
+
+void
+patch_jump (int offset)
+{
+  block_t *block = get_block ();
+  int jump = block->length - offset - 2;
+
+  if (jump > UINT16_MAX)
+    {
+      fprintf (stderr, "'if' jump is too large\n");
+      exit (1);
+    }
+
+  block->code[offset] = (jump >> 8) & 0xff;
+  block->code[offset + 1] = jump & 0xff;
+}
+
+/* how many values the code from offset 'from' to the end of the block
+   leaves on the stack. the forms in it are balanced already, so every path
+   through them agrees */
+int
+code_stack_effect (int from)
+{
+  block_t *block = get_block ();
+  int length = block->length - from;
+  int *depths = arena_alloc (&scratch, (length + 1) * sizeof (int));
+  for (int i = 0; i <= length; i++)
+    depths[i] = INT_MIN;
+
+  int depth = 0;
+  bool reachable = true;
+  for (int offset = from; offset < block->length;)
+    {
+      uint8_t *code = &block->code[offset];
+      if (depths[offset - from] != INT_MIN)
+        {
+          depth = depths[offset - from];
+          reachable = true;
+        }
+      offset += op_length (code[0]);
+      if (!reachable)
+        continue;
+
+      depth += op_stack_effect (code);
+      if (op_is_jump (code[0]) && code[0] != OP_LOOP)
+        depths[op_jump_target (block, code - block->code) - from] = depth;
+      reachable = code[0] != OP_JUMP && code[0] != OP_LOOP;
+    }
+  return depths[length] != INT_MIN && !reachable ? depths[length] : depth;
+}
+
+/* bring a path that left 'from' values to 'to', which is 0 or 1, keeping
+   its top value. 'do' leaves its inner values behind, and the paths
+   into a join must agree on the depth for the code after it to read the
+   right slots */
+void
+emit_balance (int from, int to)
+{
+  if (from < to)
+    block_push (OP_NIL);
+  for (int n = from - 1; n > 0; n -= UINT8_MAX)
+    {
+      block_push (OP_END_SCOPE);
+      block_push (n > UINT8_MAX ? UINT8_MAX : n);
+    }
+  if (from > 0 && to == 0)
+    block_push (OP_POP);
+}
+
+bool
+parse_if_form ()
+{
+  token_t token = scan_token ();
+  if (!parse_expression (token))
+    return false;
+
+  int then_offset = emit_jump (OP_JUMP_IF_FALSE);
+
+  block_push (OP_POP);
+
+  /* an arm that declares a local keeps its values where they are */
+  int locals = current->local_count;
+  int then_start = get_block ()->length;
+  token = scan_token ();
+  if (!parse_expression (token))
+    return false;
+
+  bool balance = current->local_count == locals;
+  token = scan_token ();
+  int then_depth = balance ? code_stack_effect (then_start) : 1;
+  /* without an else, the condition is the value on the other path */
+  if (balance)
+    emit_balance (then_depth, token.type == TOKEN_RPAREN ? 1
+                              : then_depth > 1 ? 1 : then_depth);
+  then_depth = then_depth > 1 || token.type == TOKEN_RPAREN ? 1 : then_depth;
+
+  int else_offset = emit_jump (OP_JUMP);
+
+  patch_jump (then_offset);
+
+  if (token.type == TOKEN_RPAREN)
+    return true;
+
+  block_push (OP_POP);
+
+  int else_start = get_block ()->length;
+  if (!parse_expression (token))
+    return false;
+
+  if (balance && current->local_count == locals)
+    emit_balance (code_stack_effect (else_start), then_depth);
+
+  patch_jump (else_offset);
+
+  token = scan_token ();
+  if (token.type != TOKEN_RPAREN)
+    {
+      fprintf (stderr, "Missing ')' or too much arguments for 'if'\n");
+      return false;
+    }
+
+  return true;
+}
+
+void
+emit_loop (int start)
+{
+  block_t *block = get_block ();
+  block_push (OP_LOOP);
+
+  int offset = block->length - start + 2;
+  if (offset > UINT16_MAX)
+    {
+      fprintf (stderr, "'while' jump is too large\n");
+      exit (1);
+    }
+
+  block_push ((offset >> 8) & 0xff);
+  block_push (offset & 0xff);
+}
+
+bool
+parse_while_form ()
+{
+  block_t *block = get_block ();
+  int start_offset = block->length;
+
+  token_t token = scan_token ();
+  if (!parse_expression (token))
+    return false;
+
+  int end_loop_offset = emit_jump (OP_JUMP_IF_FALSE);
+
+  block_push (OP_POP);
+
+  /* the loop head is a join too, so a turn drops what the body left,
+     unless the body declared a local there */
+  int locals = current->local_count;
+  int body_start = block->length;
+  token = scan_token ();
+  if (!parse_expression (token))
+    return false;
+  if (current->local_count == locals)
+    emit_balance (code_stack_effect (body_start), 0);
+
+  emit_loop (start_offset);
+
+  patch_jump (end_loop_offset);
+
+  block_push (OP_POP);
+
+  token = scan_token ();
+  if (token.type != TOKEN_RPAREN)
+    {
+      fprintf (stderr, "Missing ')' or too much arguments for 'if'\n");
+      return false;
+    }
+
+  return true;
+}
+
+bool
+parse_expression (token_t token)
+{
+  switch (token.type)
+    {
+    case TOKEN_RPAREN:
+      {
+        fprintf (stderr, "Unexpected ')'\n");
+        return false;
+      }
+    case TOKEN_LPAREN:
+      {
+        token_t first_token = scan_token ();
+        int arg_num = 0;
+
+        if (first_token.type == TOKEN_RPAREN)
+          return true;
+
+        if (first_token.type == TOKEN_END)
+          {
+            fprintf (stderr, "Missing ')'\n");
+            return false;
+          }
+
+        if (first_token.type != TOKEN_WORD)
+          {
+            fprintf (stderr, "Expression must start with a word\n");
+            return false;
+          }
+
+        if (is_token_string (first_token, "do"))
+          return parse_do_form (token);
+
+        if (is_token_string (first_token, "on"))
+          return parse_on_form ();
+
+        if (is_token_string (first_token, "put"))
+          return parse_put_form ();
+
+        if (is_token_string (first_token, "if"))
+          return parse_if_form ();
+
+        if (is_token_string (first_token, "while"))
+          return parse_while_form ();
+
+        // the callee goes below its arguments and becomes the call's slot 0
+        if (is_token_op (first_token) == OP_NOT_BUILTIN
+            && !emit_word (first_token))
+          return false;
+
+        int start = get_block ()->length;
+        if (!parse_multiple_expressions (token, &arg_num))
+          return false;
+
+        if (fold_op (first_token, start, arg_num))
+          return true;
+
+        if (!emit_op (first_token, arg_num))
+          return false;
+
+        return true;
+      }
+    case TOKEN_WORD:
+      {
+        if (!emit_word (token))
+          return false;
+        return true;
+      }
+    case TOKEN_NUMBER:
+      {
+        emit_number (token);
+        return true;
+      }
+    case TOKEN_STRING:
+      {
+        emit_string (token);
+        return true;
+      }
+    case TOKEN_END:
+      {
+        block_push (OP_RETURN);
+        return true;
+      }
+    }
+
+  fprintf (stderr, "Unrecognized token\n");
+  return false;
+}
+
+function_t *
+compile_block (const char *source)
+{
+  compiler_t *top = current;
+  scan_new (source);
+  while (1)
+    {
+      token_t token = scan_token ();
+
+      if (!parse_expression (token))
+        {
+          /* drop compilers left open by the error */
+          current = top;
+          return NULL;
+        }
+
+      if (token.type == TOKEN_END)
+        break;
+    }
+
+  if (!function_finish (current->function))
+    return NULL;
+  return current->function;
+}
+
+/* run f as the top level, whose frame already holds 'base' values below
+   vm.top, the first of them being the slot for f's closure */
+result_t
+run_top (function_t *f, int base)
+{
+  vm_push (value_from_object ((object_t *)f));
+  closure_t *c = closure_new (f);
+  vm_pop ();
+  if (vm_reserve_call (f, vm.stack) == NULL)
+    return RESULT_RUNTIME_ERROR;
+  vm.stack[0] = value_from_object ((object_t *)c);
+  vm.top = vm.stack + base;
+
+  call_t *call = &vm.calls[vm.call_count++];
+  call->closure = c;
+  call->pc = c->function->block.code;
+  call->slots = vm.stack;
+
+  result_t result;
+  if (use_registers)
+    {
+      call->pc = f->reg.code;
+      if (trace)
+        dbg_disassemble_all_registers (&f->reg);
+      result = run_reg ();
+    }
+  else
+    {
+      if (trace)
+        dbg_disassemble_all (&f->block);
+      result = run ();
+    }
+  return result;
+}
+
+result_t
+run_function (function_t *f)
+{
+  result_t result = run_top (f, 1);
+  /* closures kept in globals outlive the stack they captured from */
+  upvalue_close (vm.stack);
+  return result;
+}
+
+result_t
+interpret (char *source)
+{
+  function_t *f = compile_block (source);
+  if (f == NULL)
+    return RESULT_COMPILE_ERROR;
+  return run_function (f);
+};
 
-bool
-emit_op (token_t token, int arg_num)
+/* run each top-level form as soon as it's compiled, so a long script
+   starts before the rest of it has been looked at. the top-level locals
+   stay in their slots from one form to the next, and each form's code
+   takes them as arguments. values left over by the forms already run are
+   dropped */
+result_t
+interpret_stream (char *source)
 {
-  opcode_t op = is_token_op (token);
-  if (op == OP_NOT_BUILTIN)
+  compiler_t *top = current;
+  function_t *f = current->function;
+  scan_new (source);
+  while (1)
     {
-      bool found = emit_word (token);
-      if (!found)
-        return false;
+      int base = current->local_count;
+      token_t token = scan_token ();
+      if (!parse_expression (token))
+        {
+          current = top;
+          return RESULT_COMPILE_ERROR;
+        }
 
-      if (arg_num > 255)
+      bool end = token.type == TOKEN_END;
+      /* a call right before the return would become a tail call, which
+         reuses the frame the locals live in */
+      if (!end)
         {
-          fprintf (stderr, "Functions cannot have >255 parameters\n");
-          return false;
+          block_push (OP_NIL);
+          block_push (OP_RETURN);
         }
+      f->arity = base - 1;
+      if (!function_finish (f))
+        return RESULT_COMPILE_ERROR;
 
-      block_push (OP_CALL);
-      block_push (arg_num);
-      return true;
+      result_t result = run_top (f, base);
+      if (result != RESULT_OK || end)
+        {
+          upvalue_close (vm.stack);
+          return result;
+        }
+
+      /* the locals are roots while the next form compiles */
+      vm.top = vm.stack + current->local_count;
+
+      /* the next form starts a fresh block */
+      block_t *block = &f->block;
+      block->length = 0;
+      block->constants.length = 0;
+      block->cache_count = 0;
+      free (block->constant_index);
+      block->constant_index = NULL;
+      block->index_capacity = 0;
     }
+}
 
-  block_push (op);
+/* BYTECODE IMAGES */
 
-#ifdef DEBUG
-  printf ("emit op '%.*s'\n", token.length, token.start);
-#endif
-  return true;
-}
+/* a compiled program saved by 'pera -c', in the byte order of the machine
+   that wrote it. after the header comes a run of objects, each referring
+   only to the ones before it and the last being the top level function,
+   then the global names in slot order. code is run straight from the
+   mapped file once it's been checked, only the objects and the call caches
+   are made on loading */
+#define IMAGE_MAGIC "PERA"
+#define IMAGE_VERSION 2
+/* the image has register code as well, written under --registers */
+#define IMAGE_REGISTERS 1
 
-void
-emit_number (token_t token)
+typedef enum
 {
-  double n = strtod (token.start, NULL);
+  IMAGE_STRING,
+  IMAGE_FUNCTION,
+  IMAGE_CLOSURE,
+  IMAGE_END,
+} image_kind_t;
 
-  block_push_constant (value_from_number (n), OP_CONSTANT);
+typedef struct
+{
+  FILE *file;
+  /* object index + 1 of each string written so far */
+  table_t strings;
+  uint32_t count;
+} image_writer_t;
+
+typedef struct
+{
+  uint8_t *at;
+  uint8_t *end;
+  bool ok;
+  /* where the loaded objects start on the stack, which roots them */
+  size_t base;
+  uint32_t count;
+} image_reader_t;
+
+/* opcodes are numbered by their order in the enums, which changes without
+   IMAGE_VERSION being bumped. an image records how many there are and how
+   long each one is, so one compiled before they changed is turned away
+   rather than run as whatever its bytes now mean */
+uint32_t
+image_opcodes ()
+{
+  uint8_t lengths[OP_NOT_BUILTIN + ROP_RETURN + 1];
+  for (int op = 0; op < OP_NOT_BUILTIN; op++)
+    lengths[op] = op_length (op);
+  for (int op = 0; op <= ROP_RETURN; op++)
+    lengths[OP_NOT_BUILTIN + op] = reg_op_length (op);
+  return hash_continue (OP_NOT_BUILTIN << 8 | ROP_RETURN, (char *)lengths,
+                        sizeof (lengths));
 }
 
 void
-emit_string (token_t token)
+image_write (image_writer_t *w, const void *data, size_t size)
 {
-  value_t v = { .type = TYPE_OBJECT,
-                .as.object = (object_t *)string_copy ((char *)token.start,
-                                                      token.length) };
-
-  block_push_constant (v, OP_CONSTANT);
-
-#ifdef DEBUG
-  printf ("string '%.*s'\n", token.length, token.start);
-#endif
+  if (size > 0)
+    fwrite (data, 1, size, w->file);
 }
 
-bool parse_expression (token_t token);
-
-bool
-parse_multiple_expressions (token_t token, int *counter)
+void
+image_write_u32 (image_writer_t *w, uint32_t n)
 {
-  do
-    {
-      token = scan_token ();
-      if (token.type == TOKEN_RPAREN || token.type == TOKEN_END)
-        break;
-      if (!parse_expression (token))
-        return false;
-      (*counter)++;
-    }
-  while (1);
-
-  if (token.type != TOKEN_RPAREN)
-    {
-      fprintf (stderr, "Missing ')'\n");
-      return false;
-    }
-
-  return true;
+  image_write (w, &n, sizeof (n));
 }
 
-bool
-parse_do_form (token_t token)
+void
+image_write_u8 (image_writer_t *w, uint8_t n)
 {
-  int arg_num = 0;
-  compiler_scope_create ();
-
-  if (!parse_multiple_expressions (token, &arg_num))
-    return false;
-
-  compiler_scope_delete ();
-  return true;
+  image_write (w, &n, sizeof (n));
 }
 
-bool
-parse_on_form ()
+uint32_t
+image_write_string (image_writer_t *w, string_t *s)
 {
-  token_t next_token = scan_token ();
-  token_t name;
-  int body_expr_num;
-
-  compiler_t compiler;
-  compiler_new (&compiler, FUNCTION_USER_DEFINED);
-  compiler_scope_create ();
+  pair_t *p = table_get (&w->strings, s);
+  if (p != NULL)
+    return (uint32_t)value_as_number (p->value) - 1;
+
+  image_write_u8 (w, IMAGE_STRING);
+  image_write_u32 (w, s->length);
+  image_write (w, s->chars, s->length);
+  table_set (&w->strings, s, value_from_number (w->count + 1));
+  return w->count++;
+}
 
-  if (next_token.type != TOKEN_LPAREN)
-    {
-      fprintf (stderr, "Expected '(' to begin function declaration\n");
-      return false;
-    }
+uint32_t image_write_function (image_writer_t *w, function_t *f);
 
-  next_token = scan_token ();
-  if (next_token.type != TOKEN_WORD)
+/* write o unless it's been written, returning its index */
+uint32_t
+image_write_object (image_writer_t *w, object_t *o)
+{
+  switch (o->type)
     {
-      fprintf (stderr, "Expected name within function declaration\n");
-      return false;
+    case OBJECT_STRING:
+      return image_write_string (w, (string_t *)o);
+    case OBJECT_FUNCTION:
+      return image_write_function (w, (function_t *)o);
+    case OBJECT_CLOSURE:
+      {
+        uint32_t f = image_write_function (w, ((closure_t *)o)->function);
+        image_write_u8 (w, IMAGE_CLOSURE);
+        image_write_u32 (w, f);
+        return w->count++;
+      }
+    default:
+      /* the compiler only makes constants of the kinds above */
+      fprintf (stderr, "Can't save constant\n");
+      exit (1);
     }
+}
 
-  name = next_token;
-
-  while ((next_token = scan_token ()).type == TOKEN_WORD)
+/* the objects a function refers to go first, so the loader finds them
+   made by the time it reaches the function */
+uint32_t
+image_write_function (image_writer_t *w, function_t *f)
+{
+  block_t *block = &f->block;
+  array_t *constants = &block->constants;
+  uint32_t *objects = malloc ((constants->length + 1) * sizeof (uint32_t));
+  if (objects == NULL)
+    exit (1);
+  for (int i = 0; i < constants->length; i++)
+    if (value_is_object (constants->values[i]))
+      objects[i]
+          = image_write_object (w, value_as_object (constants->values[i]));
+  uint32_t name = f->name == NULL ? UINT32_MAX
+                                  : image_write_string (w, f->name);
+
+  image_write_u8 (w, IMAGE_FUNCTION);
+  image_write_u32 (w, name);
+  image_write_u32 (w, f->arity);
+  image_write_u32 (w, f->upvalue_count);
+  image_write (w, f->captures, f->upvalue_count * sizeof (capture_t));
+  image_write_u32 (w, block->cache_count);
+  image_write_u32 (w, block->length);
+  image_write (w, block->code, block->length);
+  image_write_u32 (w, f->reg.frame_size);
+  image_write_u32 (w, f->reg.length);
+  image_write (w, f->reg.code, f->reg.length);
+
+  image_write_u32 (w, constants->length);
+  for (int i = 0; i < constants->length; i++)
     {
-      current->function->arity++;
-      if (current->function->arity > 255)
+      value_t v = constants->values[i];
+      if (value_is_nil (v))
+        image_write_u8 (w, TYPE_NIL);
+      else if (value_is_boolean (v))
         {
-          fprintf (stderr, "Functions cannot have >255 parameters\n");
-          return false;
+          image_write_u8 (w, TYPE_BOOL);
+          image_write_u8 (w, value_as_boolean (v));
+        }
+      else if (value_is_number (v))
+        {
+          double n = value_as_number (v);
+          image_write_u8 (w, TYPE_NUMBER);
+          image_write (w, &n, sizeof (n));
+        }
+      else
+        {
+          image_write_u8 (w, TYPE_OBJECT);
+          image_write_u32 (w, objects[i]);
         }
-
-      local_set_new (next_token);
-    }
-
-  if (next_token.type != TOKEN_RPAREN)
-    {
-      fprintf (stderr, "Expected ')' to end function declaration\n");
-      return false;
     }
 
-  parse_multiple_expressions (next_token, &body_expr_num);
-
-  function_t *f = compiler_end ();
-  f->name = string_copy ((char *)name.start, name.length);
-
-  value_t v = { .type = TYPE_OBJECT, .as.object = (object_t *)f };
-  block_push_constant (v, OP_CLOSURE);
-  emit_set_local (name);
-
-  return true;
+  free (objects);
+  return w->count++;
 }
 
 bool
-parse_put_form ()
+image_save (function_t *f, const char *path)
 {
-  token_t key = scan_token ();
-  token_t next_token = scan_token ();
-
-  if (key.type != TOKEN_WORD)
+  image_writer_t w;
+  w.file = fopen (path, "wb");
+  if (w.file == NULL)
     {
-      fprintf (stderr, "First argument to 'put' must be a word\n");
+      fprintf (stderr, "Couldn't open '%s'\n", path);
       return false;
     }
-
-  if (next_token.type == TOKEN_END)
+  table_new (&w.strings);
+  w.count = 0;
+
+  image_write (&w, IMAGE_MAGIC, 4);
+  image_write_u32 (&w, IMAGE_VERSION);
+  image_write_u32 (&w, image_opcodes ());
+  image_write_u32 (&w, use_registers ? IMAGE_REGISTERS : 0);
+
+  uint32_t *names = malloc ((vm.global_names.length + 1) * sizeof (uint32_t));
+  if (names == NULL)
+    exit (1);
+  for (int i = 0; i < vm.global_names.length; i++)
+    names[i] = image_write_string (&w, global_name (i));
+  image_write_function (&w, f);
+  image_write_u8 (&w, IMAGE_END);
+
+  image_write_u32 (&w, vm.global_names.length);
+  for (int i = 0; i < vm.global_names.length; i++)
+    image_write_u32 (&w, names[i]);
+
+  free (names);
+  table_free (&w.strings);
+  bool ok = !ferror (w.file);
+  if (fclose (w.file) != 0 || !ok)
     {
-      fprintf (stderr, "Unexpected EOF\n");
+      fprintf (stderr, "Write error\n");
       return false;
     }
+  return true;
+}
 
-  if (next_token.type == TOKEN_RPAREN)
-    block_push (OP_NIL);
-  else if (!parse_expression (next_token))
-    return false;
-
-  next_token = scan_token ();
-  if (next_token.type != TOKEN_RPAREN)
+/* hand out the next size bytes of the image in place */
+uint8_t *
+image_read (image_reader_t *r, size_t size)
+{
+  if (!r->ok || (size_t)(r->end - r->at) < size)
     {
-      fprintf (stderr, "Missing ')' or too much arguments for 'put'\n");
-      return false;
+      r->ok = false;
+      return NULL;
     }
-
-  // if key starts with '_', make it global
-  if (*key.start == '_')
-    emit_set_global (key);
-  else
-    emit_set_local (key);
-
-  return true;
+  uint8_t *data = r->at;
+  r->at += size;
+  return data;
 }
 
-int
-emit_jump (opcode_t op)
+uint32_t
+image_read_u32 (image_reader_t *r)
 {
-  block_t *block = get_block ();
-  block_push (op);
-  block_push (0);
-  block_push (0);
-  return block->length - 2;
+  uint32_t n = 0;
+  uint8_t *data = image_read (r, sizeof (n));
+  if (data != NULL)
+    memcpy (&n, data, sizeof (n));
+  return n;
 }
 
-void
-patch_jump (int offset)
+uint8_t
+image_read_u8 (image_reader_t *r)
 {
-  block_t *block = get_block ();
-  int jump = block->length - offset - 2;
+  uint8_t *data = image_read (r, 1);
+  return data == NULL ? 0 : *data;
+}
 
-  if (jump > UINT16_MAX)
+/* an object loaded earlier, checked to be of the expected type */
+object_t *
+image_object (image_reader_t *r, uint32_t index, object_type_t type)
+{
+  if (index >= r->count)
     {
-      fprintf (stderr, "'if' jump is too large\n");
-      exit (1);
+      r->ok = false;
+      return NULL;
     }
+  object_t *o = value_as_object (vm.stack[r->base + index]);
+  if (o->type != type)
+    {
+      r->ok = false;
+      return NULL;
+    }
+  return o;
+}
 
-  block->code[offset] = (jump >> 8) & 0xff;
-  block->code[offset + 1] = jump & 0xff;
+/* keep a loaded object on the stack until the whole image is in */
+void
+image_add (image_reader_t *r, object_t *o)
+{
+  vm_push (value_from_object (o));
+  r->count++;
 }
 
 bool
-parse_if_form ()
+image_read_function (image_reader_t *r)
 {
-  token_t token = scan_token ();
-  if (!parse_expression (token))
-    return false;
-
-  int then_offset = emit_jump (OP_JUMP_IF_FALSE);
-
-  block_push (OP_POP);
-
-  token = scan_token ();
-  if (!parse_expression (token))
-    return false;
-
-  int else_offset = emit_jump (OP_JUMP);
-
-  patch_jump (then_offset);
-
-  token = scan_token ();
-  if (token.type == TOKEN_RPAREN)
-    return true;
-
-  block_push (OP_POP);
-
-  if (!parse_expression (token))
+  uint32_t name = image_read_u32 (r);
+  uint32_t arity = image_read_u32 (r);
+  uint32_t upvalue_count = image_read_u32 (r);
+  capture_t *captures
+      = (capture_t *)image_read (r, upvalue_count * sizeof (capture_t));
+  uint32_t cache_count = image_read_u32 (r);
+  uint32_t length = image_read_u32 (r);
+  uint8_t *code = image_read (r, length);
+  uint32_t frame_size = image_read_u32 (r);
+  uint32_t reg_length = image_read_u32 (r);
+  uint8_t *reg_code = image_read (r, reg_length);
+  if (!r->ok || arity > UINT8_MAX || upvalue_count > UINT8_OVER
+      || cache_count > UINT16_MAX + 1 || frame_size > UINT8_OVER)
     return false;
+  /* a bool holding anything but 0 or 1 isn't one */
+  for (uint32_t i = 0; i < upvalue_count; i++)
+    if (((uint8_t *)&captures[i].is_local)[0] > 1)
+      return false;
 
-  patch_jump (else_offset);
+  function_t *f = function_new ();
+  image_add (r, (object_t *)f);
+  free (f->block.code);
+  f->mapped = true;
+  f->arity = arity;
+  f->upvalue_count = upvalue_count;
+  f->captures = upvalue_count > 0 ? captures : NULL;
+  f->block.code = code;
+  f->block.length = length;
+  f->block.capacity = length;
+  f->reg.code = reg_code;
+  f->reg.length = reg_length;
+  f->reg.capacity = reg_length;
+  f->reg.frame_size = frame_size;
+
+  if (cache_count > 0)
+    {
+      f->block.caches = calloc (cache_count, sizeof (call_cache_t));
+      if (f->block.caches == NULL)
+        exit (1);
+      f->block.cache_count = cache_count;
+      f->block.cache_capacity = cache_count;
+    }
 
-  token = scan_token ();
-  if (token.type != TOKEN_RPAREN)
+  if (name != UINT32_MAX)
     {
-      fprintf (stderr, "Missing ')' or too much arguments for 'if'\n");
-      return false;
+      f->name = (string_t *)image_object (r, name, OBJECT_STRING);
+      if (f->name == NULL)
+        return false;
+      gc_write_barrier ((object_t *)f,
+                        value_from_object ((object_t *)f->name));
     }
 
-  return true;
+  uint32_t constant_count = image_read_u32 (r);
+  for (uint32_t i = 0; i < constant_count && r->ok; i++)
+    {
+      value_t v = value_nil ();
+      switch (image_read_u8 (r))
+        {
+        case TYPE_NIL:
+          break;
+        case TYPE_BOOL:
+          v = value_from_boolean (image_read_u8 (r));
+          break;
+        case TYPE_NUMBER:
+          {
+            double n = 0;
+            uint8_t *data = image_read (r, sizeof (n));
+            if (data != NULL)
+              memcpy (&n, data, sizeof (n));
+            v = value_from_number (n);
+            break;
+          }
+        case TYPE_OBJECT:
+          {
+            uint32_t index = image_read_u32 (r);
+            if (index >= r->count)
+              return false;
+            v = vm.stack[r->base + index];
+            break;
+          }
+        default:
+          return false;
+        }
+      array_push (&f->block.constants, v);
+      gc_write_barrier ((object_t *)f, v);
+    }
+  return r->ok;
 }
 
-void
-emit_loop (int start)
+/* a closure made by f may take f's locals below depth and f's upvalues */
+bool
+image_check_closure (function_t *f, int constant, int depth)
 {
-  block_t *block = get_block ();
-  block_push (OP_LOOP);
-
-  int offset = block->length - start + 2;
-  if (offset > UINT16_MAX)
+  if (constant >= f->block.constants.length
+      || !value_is_object_type (f->block.constants.values[constant],
+                                OBJECT_FUNCTION))
+    return false;
+  function_t *inner
+      = (function_t *)value_as_object (f->block.constants.values[constant]);
+  for (int i = 0; i < inner->upvalue_count; i++)
     {
-      fprintf (stderr, "'while' jump is too large\n");
-      exit (1);
+      capture_t *capture = &inner->captures[i];
+      if (capture->index >= (capture->is_local ? depth : f->upvalue_count))
+        return false;
     }
-
-  block_push ((offset >> 8) & 0xff);
-  block_push (offset & 0xff);
+  return true;
 }
 
+/* the operands of a stack instruction, run with depth values in the
+   frame */
 bool
-parse_while_form ()
+image_check_op (function_t *f, uint8_t *code, int depth)
 {
-  block_t *block = get_block ();
-  int start_offset = block->length;
-
-  token_t token = scan_token ();
-  if (!parse_expression (token))
-    return false;
-
-  int end_loop_offset = emit_jump (OP_JUMP_IF_FALSE);
+  int constants = f->block.constants.length;
+  switch (code[0])
+    {
+    case OP_CONSTANT:
+      return code[1] < constants;
+    case OP_SET_GLOBAL:
+    case OP_GET_GLOBAL:
+      return ((code[1] << 8) | code[2]) < vm.global_values.length;
+    case OP_SET_LOCAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL_POP:
+      return code[1] < depth;
+    case OP_ADD_LOCALS:
+      return code[1] < depth && code[2] < depth;
+    case OP_ADD_LOCAL_CONSTANT:
+      return code[1] < depth && code[2] < constants;
+    case OP_CLOSE:
+      return code[1] <= depth;
+    case OP_GET_UPVALUE:
+      return code[1] < f->upvalue_count;
+    case OP_CLOSURE:
+      return image_check_closure (f, code[1], depth);
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      return ((code[2] << 8) | code[3]) < f->block.cache_count;
+    default:
+      return true;
+    }
+}
 
-  block_push (OP_POP);
+/* follow the stack code the way the vm would run it. every path into an
+   instruction is taken to bring the fewest values any of them does, so a
+   local read below that depth holds a value whichever way it came, and
+   no instruction may take the frame below its arguments */
+bool
+image_check_block (function_t *f)
+{
+  block_t *block = &f->block;
+  int length = block->length;
+  int *depths = arena_alloc (&scratch, (length + 1) * sizeof (int));
+  bool *starts = arena_calloc (&scratch, (length + 1) * sizeof (bool));
 
-  token = scan_token ();
-  if (!parse_expression (token))
+  int offset = 0;
+  for (; offset < length; offset += op_length (block->code[offset]))
+    {
+      if (block->code[offset] >= OP_NOT_BUILTIN)
+        return false;
+      starts[offset] = true;
+      depths[offset] = -1;
+    }
+  if (offset != length)
     return false;
 
-  emit_loop (start_offset);
+  int base = f->arity + 1;
+  int depth = base;
+  bool reachable = true;
+  for (offset = 0; offset < length; offset += op_length (block->code[offset]))
+    {
+      uint8_t *code = &block->code[offset];
+      if (depths[offset] != -1 && (!reachable || depths[offset] < depth))
+        {
+          depth = depths[offset];
+          reachable = true;
+        }
+      if (!reachable)
+        continue;
+      depths[offset] = depth;
 
-  patch_jump (end_loop_offset);
+      if (!image_check_op (f, code, depth))
+        return false;
+      depth += op_stack_effect (code);
+      if (code[0] != OP_RETURN && depth < base)
+        return false;
 
-  block_push (OP_POP);
+      if (op_is_jump (code[0]))
+        {
+          int target = op_jump_target (block, offset);
+          if (target < 0 || target >= length || !starts[target])
+            return false;
+          /* a turn may leave values behind, but never take any */
+          if (code[0] == OP_LOOP)
+            {
+              if (depths[target] == -1 || depth < depths[target])
+                return false;
+            }
+          else if (depths[target] == -1 || depth < depths[target])
+            depths[target] = depth;
+        }
+      reachable = code[0] != OP_JUMP && code[0] != OP_LOOP
+                  && code[0] != OP_RETURN;
+    }
+  /* the last instruction can't run on past the end */
+  return !reachable;
+}
 
-  token = scan_token ();
-  if (token.type != TOKEN_RPAREN)
+/* the operands of a register instruction, in a frame of size registers */
+bool
+image_check_reg_op (function_t *f, uint8_t *code, int size)
+{
+  int constants = f->block.constants.length;
+  switch (code[0])
     {
-      fprintf (stderr, "Missing ')' or too much arguments for 'if'\n");
-      return false;
+    case ROP_NIL:
+    case ROP_TRUE:
+    case ROP_FALSE:
+    case ROP_PRINT:
+    case ROP_CLOSE:
+    case ROP_RETURN:
+      return code[1] < size;
+    case ROP_MOVE:
+    case ROP_NEG:
+    case ROP_NOT:
+      return code[1] < size && code[2] < size;
+    case ROP_LOADK:
+      return code[1] < size && code[2] < constants;
+    case ROP_SET_GLOBAL:
+      return ((code[1] << 8) | code[2]) < vm.global_values.length
+             && code[3] < size;
+    case ROP_GET_GLOBAL:
+      return code[1] < size
+             && ((code[2] << 8) | code[3]) < vm.global_values.length;
+    case ROP_ADD:
+    case ROP_SUB:
+    case ROP_MUL:
+    case ROP_DIV:
+    case ROP_MOD:
+    case ROP_EQ:
+    case ROP_CONCAT:
+      return code[1] < size && code[2] < size && code[3] < size;
+    case ROP_ADDK:
+    case ROP_SUBK:
+    case ROP_MULK:
+    case ROP_DIVK:
+    case ROP_MODK:
+    case ROP_EQK:
+      return code[1] < size && code[2] < size && code[3] < constants;
+    case ROP_JUMP_IF_FALSE:
+      return code[1] < size;
+    case ROP_GET_UPVALUE:
+      return code[1] < size && code[2] < f->upvalue_count;
+    case ROP_CLOSURE:
+      return code[1] < size && image_check_closure (f, code[2], size);
+    case ROP_CALL:
+    case ROP_TAIL_CALL:
+      return code[1] + code[2] < size
+             && ((code[3] << 8) | code[4]) < f->block.cache_count;
+    default:
+      return true;
     }
-
-  return true;
 }
 
+/* registers are all nil from the start of a call, so register code only
+   has to stay inside its frame and its jumps land on instructions */
 bool
-parse_expression (token_t token)
+image_check_registers (function_t *f)
 {
-  switch (token.type)
+  reg_block_t *reg = &f->reg;
+  int length = reg->length;
+  int size = reg->frame_size;
+  if (size <= f->arity || size > UINT8_OVER)
+    return false;
+
+  bool *starts = arena_calloc (&scratch, (length + 1) * sizeof (bool));
+  bool *entered = arena_calloc (&scratch, (length + 1) * sizeof (bool));
+  int offset = 0;
+  for (; offset < length; offset += reg_op_length (reg->code[offset]))
     {
-    case TOKEN_RPAREN:
-      {
-        fprintf (stderr, "Unexpected ')'\n");
+      if (reg->code[offset] > ROP_RETURN)
         return false;
-      }
-    case TOKEN_LPAREN:
-      {
-        token_t first_token = scan_token ();
-        int arg_num = 0;
-
-        if (first_token.type == TOKEN_RPAREN)
-          return true;
+      starts[offset] = true;
+    }
+  if (offset != length)
+    return false;
 
-        if (first_token.type == TOKEN_END)
-          {
-            fprintf (stderr, "Missing ')'\n");
-            return false;
-          }
+  bool reachable = true;
+  for (offset = 0; offset < length;)
+    {
+      uint8_t *code = &reg->code[offset];
+      int next = offset + reg_op_length (code[0]);
+      reachable = reachable || entered[offset];
+      if (reachable && !image_check_reg_op (f, code, size))
+        return false;
 
-        if (first_token.type != TOKEN_WORD)
-          {
-            fprintf (stderr, "Expression must start with a word\n");
+      if (code[0] == ROP_LOOP || code[0] == ROP_JUMP
+          || code[0] == ROP_JUMP_IF_FALSE)
+        {
+          uint16_t jump = (code[next - offset - 2] << 8)
+                          | code[next - offset - 1];
+          int target = code[0] == ROP_LOOP ? next - jump : next + jump;
+          if (target < 0 || target >= length || !starts[target])
             return false;
-          }
-
-        if (is_token_string (first_token, "do"))
-          return parse_do_form (token);
-
-        if (is_token_string (first_token, "on"))
-          return parse_on_form ();
-
-        if (is_token_string (first_token, "put"))
-          return parse_put_form ();
-
-        if (is_token_string (first_token, "if"))
-          return parse_if_form ();
-
-        if (is_token_string (first_token, "while"))
-          return parse_while_form ();
-
-        if (!parse_multiple_expressions (token, &arg_num))
-          return false;
-
-        if (!emit_op (first_token, arg_num))
-          return false;
-
-        return true;
-      }
-    case TOKEN_WORD:
-      {
-        if (!emit_word (token))
-          return false;
-        return true;
-      }
-    case TOKEN_NUMBER:
-      {
-        emit_number (token);
-        return true;
-      }
-    case TOKEN_STRING:
-      {
-        emit_string (token);
-        return true;
-      }
-    case TOKEN_END:
-      {
-        block_push (OP_RETURN);
-        return true;
-      }
+          entered[target] = true;
+        }
+      if (reachable)
+        reachable = code[0] != ROP_JUMP && code[0] != ROP_LOOP
+                    && code[0] != ROP_RETURN;
+      offset = next;
     }
+  return !reachable;
+}
 
-  fprintf (stderr, "Unrecognized token\n");
-  return false;
+/* the code in an image may be stale or damaged, so before any of it runs
+   each function is checked to refer only to what exists, and the room its
+   frame needs is worked out again rather than taken from the file */
+bool
+image_check_function (function_t *f)
+{
+  bool ok = image_check_block (f)
+            && (!use_registers || image_check_registers (f));
+  if (ok)
+    {
+      f->stack_size = stack_size (&f->block, f->arity + 1);
+      if (use_registers && f->stack_size < f->reg.frame_size)
+        f->stack_size = f->reg.frame_size;
+    }
+  arena_reset (&scratch);
+  return ok;
 }
 
+/* load the image at path, returning its top level function */
 function_t *
-compile_block (const char *source)
+image_load (const char *path)
 {
-  scan_new (source);
-  while (1)
+  int fd = open (path, O_RDONLY);
+  if (fd == -1)
     {
-      token_t token = scan_token ();
-
-      if (!parse_expression (token))
-        return NULL;
+      fprintf (stderr, "Couldn't open '%s'\n", path);
+      return NULL;
+    }
+  struct stat st;
+  if (fstat (fd, &st) == -1 || st.st_size == 0)
+    {
+      fprintf (stderr, "Empty file\n");
+      close (fd);
+      return NULL;
+    }
+  void *image = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (image == MAP_FAILED)
+    {
+      fprintf (stderr, "Couldn't map '%s'\n", path);
+      return NULL;
+    }
+  vm.image = image;
+  vm.image_size = st.st_size;
+
+  image_reader_t r
+      = { image, (uint8_t *)image + st.st_size, true, vm.top - vm.stack, 0 };
+  uint8_t *magic = image_read (&r, 4);
+  uint32_t version = image_read_u32 (&r);
+  uint32_t opcodes = image_read_u32 (&r);
+  uint32_t flags = image_read_u32 (&r);
+  if (!r.ok || memcmp (magic, IMAGE_MAGIC, 4) != 0)
+    {
+      fprintf (stderr, "'%s' isn't a pera bytecode file\n", path);
+      return NULL;
+    }
+  if (version != IMAGE_VERSION || opcodes != image_opcodes ())
+    {
+      fprintf (stderr, "'%s' was compiled by another version of pera\n",
+               path);
+      return NULL;
+    }
+  if (use_registers && !(flags & IMAGE_REGISTERS))
+    {
+      fprintf (stderr, "'%s' was compiled without --registers\n", path);
+      return NULL;
+    }
 
-      if (token.type == TOKEN_END)
-        break;
+  image_kind_t kind;
+  while (r.ok && (kind = image_read_u8 (&r)) != IMAGE_END)
+    {
+      if (vm.top == vm.stack_end && !vm_stack_grow (r.base + r.count + 1))
+        r.ok = false;
+      else if (kind == IMAGE_STRING)
+        {
+          uint32_t length = image_read_u32 (&r);
+          char *chars = (char *)image_read (&r, length);
+          if (chars != NULL)
+            image_add (&r, (object_t *)string_allocate (chars, length));
+        }
+      else if (kind == IMAGE_FUNCTION)
+        r.ok = image_read_function (&r);
+      else if (kind == IMAGE_CLOSURE)
+        {
+          /* only closures over nothing are saved whole */
+          object_t *f = image_object (&r, image_read_u32 (&r),
+                                      OBJECT_FUNCTION);
+          if (f != NULL && ((function_t *)f)->upvalue_count > 0)
+            r.ok = false;
+          else if (f != NULL)
+            image_add (&r, (object_t *)closure_new ((function_t *)f));
+        }
+      else
+        r.ok = false;
     }
-  return current->function;
-}
 
-result_t
-interpret (char *source)
-{
-  function_t *f = compile_block (source);
-  if (f == NULL)
-    return RESULT_COMPILE_ERROR;
+  /* slots were given out in this order when the image was compiled */
+  uint32_t global_count = image_read_u32 (&r);
+  for (uint32_t i = 0; i < global_count && r.ok; i++)
+    {
+      object_t *name = image_object (&r, image_read_u32 (&r), OBJECT_STRING);
+      r.ok = name != NULL && global_declare ((string_t *)name) == (int)i;
+    }
 
-  closure_t *c = closure_new (f);
-  vm_push ((value_t){ .type = TYPE_OBJECT, .as.object = (object_t *)c });
+  /* the code can be checked once every global it names has its slot */
+  for (uint32_t i = 0; i < r.count && r.ok; i++)
+    {
+      object_t *o = value_as_object (vm.stack[r.base + i]);
+      if (o->type == OBJECT_FUNCTION)
+        r.ok = image_check_function ((function_t *)o);
+    }
 
-  call_t *call = &vm.calls[vm.call_count++];
-  call->closure = c;
-  call->pc = c->function->block.code;
-  call->slots = vm.stack;
+  function_t *f = NULL;
+  if (r.ok && r.count > 0)
+    f = (function_t *)image_object (&r, r.count - 1, OBJECT_FUNCTION);
+  if (f != NULL && (f->arity != 0 || f->upvalue_count != 0))
+    f = NULL;
+  vm.top = vm.stack + r.base;
+  if (f == NULL)
+    fprintf (stderr, "'%s' is damaged\n", path);
+  return f;
+}
 
-#ifdef DEBUG
-  dbg_disassemble_all ();
-#endif
+bool
+image_detect (const char *path)
+{
+  char magic[4];
+  FILE *file = fopen (path, "rb");
+  if (file == NULL)
+    return false;
+  bool detected = fread (magic, 1, 4, file) == 4
+                  && memcmp (magic, IMAGE_MAGIC, 4) == 0;
+  fclose (file);
+  return detected;
+}
 
-  return run ();
-};
+/* 'pera -c': compile the source at in and save it at out */
+bool
+image_compile (char *source, const char *out)
+{
+  function_t *f = compile_block (source);
+  return f != NULL && image_save (f, out);
+}
 
 void
 repl ()
@@ -1908,50 +6464,137 @@ repl ()
     }
 }
 
-char *
-read (const char *path)
+/* SOURCE FILES */
+
+/* a script's text, ending in a '\0' the scanner stops at */
+typedef struct
 {
-  FILE *file = fopen (path, "rb");
-  if (file == NULL)
+  char *chars;
+  size_t length;
+  /* bytes mapped, or 0 when the text was read into the heap */
+  size_t mapped;
+} source_t;
+
+/* map a regular file one page past its end. the rest of its last page
+   reads as zeros, and an anonymous page underneath covers a file that
+   ends on a page boundary, so there's always a terminator */
+bool
+source_map (source_t *source, int fd, size_t size)
+{
+  size_t page = sysconf (_SC_PAGESIZE);
+  size_t mapped = (size / page + 1) * page;
+  char *chars = mmap (NULL, mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+  if (chars == MAP_FAILED)
+    return false;
+  if (mmap (chars, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0)
+      == MAP_FAILED)
     {
-      fprintf (stderr, "Couldn't open '%s'\n", path);
-      exit (1);
+      munmap (chars, mapped);
+      return false;
     }
 
-  fseek (file, 0, SEEK_END);
-  size_t size = ftell (file);
-  rewind (file);
+  source->chars = chars;
+  source->length = size;
+  source->mapped = mapped;
+  return true;
+}
 
-  if (size == 0)
+/* pipes, terminals and anything else that can't be mapped */
+void
+source_read (source_t *source, int fd)
+{
+  size_t capacity = 4096;
+  size_t length = 0;
+  char *chars = malloc (capacity);
+  if (chars == NULL)
     {
-      fprintf (stderr, "Empty file\n");
+      fprintf (stderr, "Out of memory\n");
       exit (1);
     }
 
-  char *buffer = malloc (size - 1);
-  if (buffer == NULL)
+  while (1)
     {
-      fprintf (stderr, "Out of memory\n");
+      if (length + 1 == capacity)
+        {
+          capacity *= 2;
+          chars = realloc (chars, capacity);
+          if (chars == NULL)
+            {
+              fprintf (stderr, "Out of memory\n");
+              exit (1);
+            }
+        }
+      ssize_t bytes = read (fd, chars + length, capacity - length - 1);
+      if (bytes == 0)
+        break;
+      if (bytes < 0)
+        {
+          fprintf (stderr, "Read error\n");
+          exit (1);
+        }
+      length += bytes;
+    }
+
+  chars[length] = '\0';
+  source->chars = chars;
+  source->length = length;
+  source->mapped = 0;
+}
+
+/* '-' is the standard input */
+void
+source_open (source_t *source, const char *path)
+{
+  int fd = strcmp (path, "-") == 0 ? STDIN_FILENO : open (path, O_RDONLY);
+  if (fd == -1)
+    {
+      fprintf (stderr, "Couldn't open '%s'\n", path);
       exit (1);
     }
-  size_t bytes = fread (buffer, sizeof (char), size, file);
-  if (bytes < size)
+
+  struct stat st;
+  if (fstat (fd, &st) == -1 || !S_ISREG (st.st_mode) || st.st_size == 0
+      || !source_map (source, fd, st.st_size))
+    source_read (source, fd);
+  if (fd != STDIN_FILENO)
+    close (fd);
+
+  if (source->length == 0)
     {
-      fprintf (stderr, "Read error\n");
+      fprintf (stderr, "Empty file\n");
       exit (1);
     }
-  buffer[bytes] = '\0';
+}
 
-  fclose (file);
-  return buffer;
+void
+source_close (source_t *source)
+{
+  if (source->mapped > 0)
+    munmap (source->chars, source->mapped);
+  else
+    free (source->chars);
 }
 
 void
 run_file (const char *path)
 {
-  char *source = read (path);
-  result_t result = interpret (source);
-  free (source);
+  result_t result;
+  if (image_detect (path))
+    {
+      function_t *f = image_load (path);
+      if (f == NULL)
+        exit (1);
+      result = run_function (f);
+    }
+  else
+    {
+      source_t source;
+      source_open (&source, path);
+      result = stream ? interpret_stream (source.chars)
+                      : interpret (source.chars);
+      source_close (&source);
+    }
 
   switch (result)
     {
@@ -1981,20 +6624,82 @@ main (int argc, const char *argv[])
 {
   compiler_t compiler;
 
+  int arg = 1;
+  for (; arg < argc && strncmp (argv[arg], "--", 2) == 0; arg++)
+    {
+      if (strcmp (argv[arg], "--trace") == 0)
+        trace = true;
+      else if (strcmp (argv[arg], "--registers") == 0)
+        use_registers = true;
+      else if (strcmp (argv[arg], "--stream") == 0)
+        stream = true;
+      else if (strcmp (argv[arg], "--incremental") == 0)
+        gc_incremental = true;
+      else if (strncmp (argv[arg], "--incremental=", 14) == 0)
+        {
+          /* objects marked or swept per allocation */
+          gc_incremental = true;
+          gc_budget = atoi (argv[arg] + 14);
+          if (gc_budget < 1)
+            {
+              fprintf (stderr, "GC budget must be at least 1\n");
+              exit (1);
+            }
+        }
+      else if (strncmp (argv[arg], "--stack=", 8) == 0)
+        {
+          /* values the stack starts with, it grows as needed */
+          stack_initial = atoi (argv[arg] + 8);
+          if (stack_initial < 1 || stack_initial > STACK_MAX)
+            {
+              fprintf (stderr, "Stack size must be 1 to %d\n", STACK_MAX);
+              exit (1);
+            }
+        }
+      else if (strncmp (argv[arg], "--frames=", 9) == 0)
+        {
+          frames_initial = atoi (argv[arg] + 9);
+          if (frames_initial < 1 || frames_initial > FRAMES_MAX)
+            {
+              fprintf (stderr, "Frame count must be 1 to %d\n", FRAMES_MAX);
+              exit (1);
+            }
+        }
+      else
+        break;
+    }
+
   vm_new ();
   compiler_new (&compiler, FUNCTION_TOP_LEVEL);
 
+  if (arg + 3 == argc && strcmp (argv[arg], "-c") == 0)
+    {
+      source_t source;
+      source_open (&source, argv[arg + 1]);
+      bool ok = image_compile (source.chars, argv[arg + 2]);
+      source_close (&source);
+      if (!ok)
+        fprintf (stderr, "Compile error\n");
+      vm_free ();
+      return ok ? 0 : 1;
+    }
+
   init_message ();
-  if (argc == 1)
+  if (arg == argc)
     repl ();
-  else if (argc == 2)
-    run_file (argv[1]);
+  else if (arg + 1 == argc)
+    run_file (argv[arg]);
   else
     {
-      fprintf (stderr, "Usage: pera [file_path]\n");
+      fprintf (stderr, "Usage: pera [--trace] [--registers] [--stream] "
+                       "[--incremental[=budget]] [--stack=values] "
+                       "[--frames=count] [file_path | -c in out]\n");
       exit (1);
     }
 
+  if (gc_incremental)
+    fprintf (stderr, "gc max pause %.3f ms\n", vm.gc_max_pause * 1000);
+
   vm_free ();
   return 0;
 }
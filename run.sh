@@ -1,3 +1,3 @@
 #!/bin/sh
 
-cc pera.c -lm && ./a.out && rm ./a.out
+cc -O2 pera.c -lm && ./a.out "$@" && rm ./a.out